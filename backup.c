@@ -0,0 +1,235 @@
+/*
+ * Copyright (C) 2022 John Crispin <john@phrozen.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <limits.h>
+#include <unistd.h>
+
+#include <libubox/uloop.h>
+
+#include "db.h"
+
+/* ms between two backup steps, ingest runs in between */
+#define BACKUP_INTERVAL		10
+
+static void backup_step_cb(struct uloop_timeout *t);
+
+/* split off families are copied one after the other, each to <path>.<family> */
+static struct {
+	struct uloop_timeout timeout;
+	sqlite3_backup *backup;
+	sqlite3 *dest;
+	int idx;
+
+	char base[PATH_MAX];
+	char path[PATH_MAX];
+	char tmp[PATH_MAX];
+	int result;
+} backup = {
+	.timeout.cb = backup_step_cb,
+	.result = SQLITE_OK,
+};
+
+static int
+backup_open(int idx)
+{
+	int rc;
+
+	backup.idx = idx;
+	db_family_path(backup.path, sizeof(backup.path), backup.base, idx);
+	snprintf(backup.tmp, sizeof(backup.tmp), "%s.tmp", backup.path);
+	unlink(backup.tmp);
+
+	rc = sqlite3_open(backup.tmp, &backup.dest);
+	if (rc == SQLITE_OK) {
+		backup.backup = sqlite3_backup_init(backup.dest, "main", db_handle[idx], "main");
+		if (!backup.backup)
+			rc = sqlite3_errcode(backup.dest);
+	}
+
+	if (rc != SQLITE_OK) {
+		ulog(LOG_ERR, "Cannot start backup to %s: %s\n", backup.path, sqlite3_errmsg(backup.dest));
+		sqlite3_close(backup.dest);
+		backup.dest = NULL;
+		unlink(backup.tmp);
+		return -1;
+	}
+
+	uloop_timeout_set(&backup.timeout, 0);
+
+	return 0;
+}
+
+static int
+backup_next(void)
+{
+	int idx;
+
+	for (idx = backup.idx + 1; idx < __DB_MAX; idx++)
+		if (db_handle[idx] != db)
+			return backup_open(idx) ? -1 : 1;
+
+	return 0;
+}
+
+static void
+backup_finish(int rc)
+{
+	uloop_timeout_cancel(&backup.timeout);
+
+	sqlite3_backup_finish(backup.backup);
+	sqlite3_close(backup.dest);
+	backup.backup = NULL;
+	backup.dest = NULL;
+	backup.result = rc;
+
+	/* the snapshot only shows up under its real name once it is complete */
+	if (rc == SQLITE_DONE && !rename(backup.tmp, backup.path)) {
+		backup.result = SQLITE_OK;
+		rc = backup_next();
+		if (!rc)
+			ulog(LOG_INFO, "backup to %s completed\n", backup.base);
+		if (rc < 0)
+			backup.result = SQLITE_CANTOPEN;
+		return;
+	}
+
+	ulog(LOG_ERR, "backup to %s failed: %s\n", backup.path, sqlite3_errstr(rc));
+	unlink(backup.tmp);
+}
+
+static void
+backup_step_cb(struct uloop_timeout *t)
+{
+	int rc = sqlite3_backup_step(backup.backup, config.backup_pages);
+
+	switch (rc) {
+	case SQLITE_OK:
+	case SQLITE_BUSY:
+	case SQLITE_LOCKED:
+		uloop_timeout_set(t, BACKUP_INTERVAL);
+		break;
+	default:
+		backup_finish(rc);
+		break;
+	}
+}
+
+int
+backup_start(char *path)
+{
+	if (backup.backup)
+		return -1;
+
+	/*
+	 * the snapshot only covers main, pending repeats go out first as
+	 * they point at hot rowids that the flush hands out again
+	 */
+	event_coalesce_flush(1);
+	tier_flush(1);
+
+	snprintf(backup.base, sizeof(backup.base), "%s", path);
+	backup.result = SQLITE_OK;
+
+	return backup_open(DB_MAIN);
+}
+
+void
+backup_stop(void)
+{
+	if (backup.backup)
+		backup_finish(SQLITE_ABORT);
+}
+
+void
+backup_status(struct blob_buf *b)
+{
+	blobmsg_add_u8(b, "running", !!backup.backup);
+	if (!backup.base[0])
+		return;
+
+	blobmsg_add_string(b, "path", backup.path);
+	if (backup.backup) {
+		blobmsg_add_u32(b, "pagecount", sqlite3_backup_pagecount(backup.backup));
+		blobmsg_add_u32(b, "remaining", sqlite3_backup_remaining(backup.backup));
+	} else {
+		blobmsg_add_string(b, "result", sqlite3_errstr(backup.result));
+	}
+}
+
+/*
+ * The restore option only seeds a database that does not exist yet or is
+ * still empty. Once a file holds a schema it is left alone, so the option
+ * can stay set across restarts without rolling live data back to the
+ * snapshot. To restore over existing data, remove the file first.
+ */
+static int
+backup_empty(sqlite3 *h)
+{
+	sqlite3_stmt *stmt;
+	int rc, empty = 0;
+
+	db_prepare_on(h, rc, stmt, "SELECT COUNT(*) FROM sqlite_master");
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+		empty = !sqlite3_column_int(stmt, 0);
+	sqlite3_finalize(stmt);
+
+	return empty;
+}
+
+int
+backup_restore(sqlite3 *h, char *path)
+{
+	sqlite3_backup *restore;
+	sqlite3 *src;
+	int rc;
+
+	/* first boot, or a family that was never split off when the snapshot was taken */
+	if (access(path, R_OK)) {
+		ulog(LOG_INFO, "no snapshot at %s, nothing to restore\n", path);
+		return SQLITE_OK;
+	}
+
+	if (!backup_empty(h)) {
+		ulog(LOG_INFO, "database already holds data, not restoring %s\n", path);
+		return SQLITE_OK;
+	}
+
+	rc = sqlite3_open_v2(path, &src, SQLITE_OPEN_READONLY, NULL);
+	if (rc != SQLITE_OK) {
+		ulog(LOG_ERR, "Cannot open snapshot %s: %s\n", path, sqlite3_errmsg(src));
+		sqlite3_close(src);
+		return rc;
+	}
+
+	restore = sqlite3_backup_init(h, "main", src, "main");
+	if (!restore) {
+		rc = sqlite3_errcode(h);
+	} else {
+		rc = sqlite3_backup_step(restore, -1);
+		sqlite3_backup_finish(restore);
+		if (rc == SQLITE_DONE)
+			rc = SQLITE_OK;
+	}
+
+	if (rc != SQLITE_OK)
+		ulog(LOG_ERR, "Cannot restore snapshot %s: %s\n", path, sqlite3_errstr(rc));
+	else
+		ulog(LOG_INFO, "restored database from %s\n", path);
+
+	sqlite3_close(src);
+
+	return rc;
+}
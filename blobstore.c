@@ -0,0 +1,186 @@
+/*
+ * Copyright (C) 2022 John Crispin <john@phrozen.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <time.h>
+
+#include <libubox/md5.h>
+
+#include "db.h"
+
+/*
+ * state and health payloads in main are kept once per content in
+ * blob_store, the rows only carry the md5 of their payload in the hash
+ * column. The refs column is maintained by triggers on the row tables,
+ * so any DELETE - purge, device_remove, eviction - releases its
+ * references and drops payloads nobody points at anymore. Rows in the
+ * hot tier and rows written before the store existed carry their
+ * payload inline and have no hash.
+ *
+ * md5 is not collision resistant, so a hash that is already taken only
+ * gets reused if the stored bytes are the same. A payload colliding with
+ * a different one is kept inline in its row like an unhashed one.
+ */
+
+#define BLOBSTORE_HASH_LEN	16
+
+static void
+blobstore_hash(const void *data, int len, uint8_t *hash)
+{
+	md5_ctx_t ctx;
+
+	md5_begin(&ctx);
+	md5_hash(data, len, &ctx);
+	md5_end(hash, &ctx);
+}
+
+/* blob_hash(payload), used when rows are copied over from the hot tier or an import */
+static void
+blobstore_hash_func(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+	uint8_t hash[BLOBSTORE_HASH_LEN];
+
+	if (sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+		sqlite3_result_null(ctx);
+		return;
+	}
+
+	blobstore_hash(sqlite3_value_blob(argv[0]), sqlite3_value_bytes(argv[0]), hash);
+	sqlite3_result_blob(ctx, hash, sizeof(hash), SQLITE_TRANSIENT);
+}
+
+int
+blobstore_init(sqlite3 *h)
+{
+	int rc = sqlite3_create_function(h, "blob_hash", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC,
+					 NULL, blobstore_hash_func, NULL, NULL);
+
+	if (rc != SQLITE_OK)
+		ulog(LOG_ERR, "Cannot register blob_hash: %s\n", sqlite3_errmsg(h));
+
+	return rc;
+}
+
+static int
+blobstore_bind_hash(sqlite3_stmt *stmt, uint8_t *hash)
+{
+	int idx = sqlite3_bind_parameter_index(stmt, "@hash");
+
+	if (sqlite3_bind_blob(stmt, idx, hash, BLOBSTORE_HASH_LEN, SQLITE_STATIC) != SQLITE_OK) {
+		ulog(LOG_ERR, "SQL error (%s:%d): %s\n", __func__, __LINE__, sqlite3_errmsg(sqlite3_db_handle(stmt)));
+		sqlite3_finalize(stmt);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* returns 1 if the hash is taken by a different payload */
+static int
+blobstore_match(sqlite3 *h, struct blob_attr *attr, uint8_t *hash)
+{
+	char *sql = "SELECT data = @data FROM main.blob_store WHERE hash = @hash";
+	sqlite3_stmt *stmt;
+	int rc, match = 0;
+
+	db_prepare_on(h, rc, stmt, sql);
+
+	if (blobstore_bind_hash(stmt, hash))
+		return -1;
+	db_bind_blob(stmt, "@data", attr);
+
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+		match = sqlite3_column_int(stmt, 0);
+	sqlite3_finalize(stmt);
+
+	return !match;
+}
+
+static int
+blobstore_add(sqlite3 *h, struct blob_attr *attr, uint8_t *hash)
+{
+	/* refs starts at 0, the insert trigger of the row referencing it takes care of that */
+	char *sql = "INSERT OR IGNORE INTO main.blob_store (hash, data, refs) VALUES(@hash, @data, 0)";
+	sqlite3_stmt *stmt;
+	int rc;
+
+	/* hash exactly the bytes __db_bind_blob() stores */
+	blobstore_hash(blobmsg_data(attr), blobmsg_data_len(attr), hash);
+
+	db_prepare_on(h, rc, stmt, sql);
+
+	if (blobstore_bind_hash(stmt, hash))
+		return -1;
+	db_bind_blob(stmt, "@data", attr);
+
+	rc = db_insert(stmt);
+	if (rc || sqlite3_changes(h))
+		return rc;
+
+	return blobstore_match(h, attr, hash);
+}
+
+static int
+blobstore_row(sqlite3 *h, char *table, char *serial, struct blob_attr *attr, uint8_t *hash)
+{
+	sqlite3_stmt *stmt;
+	char sql[256];
+	int rc;
+
+	/* seq only has to tell apart rows of the same device and second */
+	snprintf(sql, sizeof(sql),
+		 "INSERT INTO main.%s (serial, %s, timestamp, hash, seq) VALUES(@serial, %s, @timestamp, %s, "
+		 "(SELECT IFNULL(MAX(seq), 0) + 1 FROM main.%s WHERE serial = @serial AND timestamp = @timestamp))",
+		 table, table, hash ? "X''" : "@data", hash ? "@hash" : "NULL", table);
+
+	db_prepare_on(h, rc, stmt, sql);
+
+	db_bind_text(stmt, "@serial", serial);
+	db_bind_int64(stmt, "@timestamp", time(NULL));
+	if (hash) {
+		if (blobstore_bind_hash(stmt, hash))
+			return -1;
+	} else {
+		db_bind_blob(stmt, "@data", attr);
+	}
+
+	return db_insert(stmt);
+}
+
+int
+blobstore_insert(sqlite3 *h, char *table, char *serial, struct blob_attr *attr)
+{
+	uint8_t hash[BLOBSTORE_HASH_LEN];
+	int rc;
+
+	rc = db_exec_on(h, "BEGIN TRANSACTION;");
+	if (rc)
+		return rc;
+
+	rc = blobstore_add(h, attr, hash);
+	if (rc == 1) {
+		ulog(LOG_WARNING, "%s payload of %s collides with a stored one, keeping it inline\n", table, serial);
+		rc = blobstore_row(h, table, serial, attr, NULL);
+	} else if (!rc) {
+		rc = blobstore_row(h, table, serial, attr, hash);
+	}
+
+	if (rc) {
+		db_exec_on(h, "ROLLBACK;");
+		return rc;
+	}
+
+	return db_exec_on(h, "COMMIT;");
+}
@@ -0,0 +1,322 @@
+/*
+ * Copyright (C) 2022 John Crispin <john@phrozen.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <libubox/uloop.h>
+
+#include "db.h"
+
+/*
+ * With config.max_bytes set, the persistent files are kept below that
+ * size. Once the used pages cross the high watermark, the oldest rows of
+ * state/health/event get evicted in chunks, split up by config.weight,
+ * until usage drops below the low watermark. The databases run with
+ * auto_vacuum=INCREMENTAL so freed pages are handed back to the
+ * filesystem a few at a time instead of by a full VACUUM.
+ */
+
+/* how often usage gets checked and how fast chunks follow each other while evicting */
+#define BUDGET_INTERVAL		30
+#define BUDGET_STEP		100
+
+/* pages handed back to the filesystem per step and file */
+#define BUDGET_VACUUM_PAGES	256
+
+struct budget_family {
+	int idx;
+	int cache;
+	char *counter;
+	char *counter_drop;
+	char *fts;
+	char *evict;
+	char *evict_clustered;
+};
+
+/* the chunk of events an eviction step takes out */
+#define BUDGET_EVENT_OLDEST	"(SELECT rowid FROM main.event ORDER BY rowid LIMIT @rows)"
+
+/* the (type, serial, bucket) counter key of an event row */
+#define BUDGET_EVENT_BUCKET	"type, IFNULL(serial, ''), timestamp - timestamp % " db_str(EVENT_COUNT_BUCKET)
+
+/* rowids grow with the insertion time, the lowest ones are the oldest rows */
+static const struct budget_family budget_families[] = {
+	{
+		.idx = DB_STATE,
+		.cache = CACHE_TABLE_STATE,
+		.evict = "DELETE FROM main.state WHERE rowid IN "
+			"(SELECT rowid FROM main.state ORDER BY rowid LIMIT @rows)",
+		.evict_clustered = "DELETE FROM main.state WHERE (serial, timestamp, seq) IN "
+			"(SELECT serial, timestamp, seq FROM main.state ORDER BY timestamp LIMIT @rows)",
+	}, {
+		.idx = DB_HEALTH,
+		.cache = CACHE_TABLE_HEALTH,
+		.evict = "DELETE FROM main.health WHERE rowid IN "
+			"(SELECT rowid FROM main.health ORDER BY rowid LIMIT @rows)",
+		.evict_clustered = "DELETE FROM main.health WHERE (serial, timestamp, seq) IN "
+			"(SELECT serial, timestamp, seq FROM main.health ORDER BY timestamp LIMIT @rows)",
+	}, {
+		.idx = DB_EVENT,
+		.cache = CACHE_TABLE_EVENT,
+		/* event_count must not keep reporting what event_list no longer has */
+		.counter = "UPDATE main.event_counter SET count = count - "
+			"(SELECT SUM(e.count) FROM main.event e WHERE e.rowid IN " BUDGET_EVENT_OLDEST " AND "
+			"e.type = event_counter.type AND IFNULL(e.serial, '') = event_counter.serial AND "
+			"e.timestamp - e.timestamp % " db_str(EVENT_COUNT_BUCKET) " = event_counter.bucket) "
+			"WHERE (type, serial, bucket) IN "
+			"(SELECT " BUDGET_EVENT_BUCKET " FROM main.event WHERE rowid IN " BUDGET_EVENT_OLDEST ")",
+		.counter_drop = "DELETE FROM main.event_counter WHERE count <= 0 AND (type, serial, bucket) IN "
+			"(SELECT " BUDGET_EVENT_BUCKET " FROM main.event WHERE rowid IN " BUDGET_EVENT_OLDEST ")",
+		.fts = "INSERT INTO event_fts (event_fts, rowid, event) "
+			"SELECT 'delete', rowid, event FROM main.event WHERE typeof(event) = 'text' AND rowid IN "
+			BUDGET_EVENT_OLDEST,
+		.evict = "DELETE FROM main.event WHERE rowid IN " BUDGET_EVENT_OLDEST,
+	},
+};
+
+static void budget_cb(struct uloop_timeout *t);
+
+static struct {
+	struct uloop_timeout timeout;
+	int evicting;
+	uint64_t evicted;
+	int64_t usage;
+} budget = {
+	.timeout.cb = budget_cb,
+};
+
+static int64_t
+budget_pragma(sqlite3 *h, char *pragma)
+{
+	sqlite3_stmt *stmt;
+	int64_t ret = -1;
+	char sql[64];
+
+	snprintf(sql, sizeof(sql), "PRAGMA main.%s;", pragma);
+	if (sqlite3_prepare_v2(h, sql, -1, &stmt, 0) != SQLITE_OK) {
+		ulog(LOG_ERR, "SQL error (%s:%d): %s\n", __func__, __LINE__, sqlite3_errmsg(h));
+		return -1;
+	}
+
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+		ret = sqlite3_column_int64(stmt, 0);
+	sqlite3_finalize(stmt);
+
+	return ret;
+}
+
+static int
+budget_distinct(int idx)
+{
+	return idx == DB_MAIN || (db_handle[idx] && db_handle[idx] != db);
+}
+
+/* bytes that would be left once the freelist has been vacuumed */
+static int64_t
+budget_used(void)
+{
+	int64_t used = 0;
+	int i;
+
+	for (i = 0; i < __DB_MAX; i++) {
+		int64_t pages, free, size;
+
+		if (!budget_distinct(i))
+			continue;
+
+		pages = budget_pragma(db_handle[i], "page_count");
+		free = budget_pragma(db_handle[i], "freelist_count");
+		size = budget_pragma(db_handle[i], "page_size");
+		if (pages < 0 || free < 0 || size < 0)
+			return -1;
+
+		used += (pages - free) * size;
+	}
+
+	return used;
+}
+
+static void
+budget_vacuum(void)
+{
+	char sql[64];
+	int i;
+
+	snprintf(sql, sizeof(sql), "PRAGMA main.incremental_vacuum(%d);", BUDGET_VACUUM_PAGES);
+
+	for (i = 0; i < __DB_MAX; i++)
+		if (budget_distinct(i) && budget_pragma(db_handle[i], "freelist_count") > 0)
+			db_exec_on(db_handle[i], sql);
+}
+
+static int
+budget_exec(sqlite3 *h, char *sql, int rows)
+{
+	sqlite3_stmt *stmt;
+	int rc;
+
+	db_prepare_on(h, rc, stmt, sql);
+	db_bind_int64(stmt, "@rows", rows);
+
+	return db_delete(stmt);
+}
+
+static int
+budget_evict_family(const struct budget_family *f, int rows)
+{
+	sqlite3 *h = db_handle[f->idx];
+	int rc;
+
+	cache_bump(f->cache, NULL);
+
+	rc = db_exec_on(h, "BEGIN TRANSACTION;");
+	if (rc)
+		return -1;
+
+	/* counters and the fts index go first, they look up the rows about to be evicted */
+	if (f->counter)
+		rc = budget_exec(h, f->counter, rows);
+	if (!rc && f->counter_drop)
+		rc = budget_exec(h, f->counter_drop, rows);
+	if (!rc && f->fts && config.fts)
+		rc = budget_exec(h, f->fts, rows);
+	/* clustered tables have no rowid, they go by their timestamp index */
+	if (!rc)
+		rc = budget_exec(h, config.clustered && f->evict_clustered ? f->evict_clustered : f->evict, rows);
+
+	if (rc) {
+		db_exec_on(h, "ROLLBACK;");
+		return -1;
+	}
+	rows = sqlite3_changes(h);
+
+	if (db_exec_on(h, "COMMIT;"))
+		return -1;
+
+	return rows;
+}
+
+/* returns the number of rows that were evicted, 0 once there is nothing left */
+static int
+budget_evict(void)
+{
+	int weight = 0, evicted = 0;
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(budget_families); i++)
+		weight += config.weight[budget_families[i].idx];
+	if (!weight)
+		return 0;
+
+	for (i = 0; i < ARRAY_SIZE(budget_families); i++) {
+		const struct budget_family *f = &budget_families[i];
+		int rows = config.budget_chunk * config.weight[f->idx] / weight;
+		int rc;
+
+		if (rows < 1)
+			continue;
+
+		rc = budget_evict_family(f, rows);
+		if (rc > 0)
+			evicted += rc;
+	}
+
+	return evicted;
+}
+
+static void
+budget_cb(struct uloop_timeout *t)
+{
+	int64_t high = (int64_t) config.max_bytes * config.budget_high / 100;
+	int64_t low = (int64_t) config.max_bytes * config.budget_low / 100;
+	int evicted;
+
+	budget_vacuum();
+
+	budget.usage = budget_used();
+	if (budget.usage < 0) {
+		uloop_timeout_set(t, BUDGET_INTERVAL * 1000);
+		return;
+	}
+
+	if (!budget.evicting && budget.usage > high) {
+		ulog(LOG_INFO, "database uses %lld bytes, evicting old rows\n", (long long) budget.usage);
+		budget.evicting = 1;
+	}
+
+	if (budget.evicting && budget.usage <= low)
+		budget.evicting = 0;
+
+	if (!budget.evicting) {
+		uloop_timeout_set(t, BUDGET_INTERVAL * 1000);
+		return;
+	}
+
+	evicted = budget_evict();
+	budget.evicted += evicted;
+
+	/* nothing left that could be evicted, the budget is too small for the hot data */
+	if (!evicted) {
+		ulog(LOG_ERR, "database uses %lld bytes, nothing left to evict\n", (long long) budget.usage);
+		budget.evicting = 0;
+		uloop_timeout_set(t, BUDGET_INTERVAL * 1000);
+		return;
+	}
+
+	uloop_timeout_set(t, BUDGET_STEP);
+}
+
+int
+budget_prepare(sqlite3 *h)
+{
+	if (!config.max_bytes || budget_pragma(h, "auto_vacuum") == 2)
+		return 0;
+
+	/* switching an existing file over needs one full VACUUM, it is a no-op on new ones */
+	ulog(LOG_INFO, "enabling incremental vacuum on %s\n", sqlite3_db_filename(h, "main"));
+
+	if (db_exec_on(h, "PRAGMA main.auto_vacuum = INCREMENTAL;"))
+		return -1;
+
+	return db_exec_on(h, "VACUUM main;");
+}
+
+void
+budget_start(void)
+{
+	if (!config.max_bytes)
+		return;
+
+	uloop_timeout_set(&budget.timeout, 0);
+}
+
+void
+budget_stop(void)
+{
+	uloop_timeout_cancel(&budget.timeout);
+	budget.evicting = 0;
+}
+
+void
+budget_status(struct blob_buf *b)
+{
+	blobmsg_add_u8(b, "enabled", !!config.max_bytes);
+	if (!config.max_bytes)
+		return;
+
+	blobmsg_add_u64(b, "max_bytes", config.max_bytes);
+	blobmsg_add_u64(b, "used", budget.usage);
+	blobmsg_add_u8(b, "evicting", budget.evicting);
+	blobmsg_add_u64(b, "evicted", budget.evicted);
+}
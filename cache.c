@@ -0,0 +1,206 @@
+/*
+ * Copyright (C) 2022 John Crispin <john@phrozen.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+
+#include "db.h"
+
+/*
+ * Finished list replies are kept keyed by method and request message.
+ * Every write bumps generation counters of the table it touches: one
+ * for the whole table, one for the bucket its serial hashes to, or - for
+ * writes spanning many serials like purges and eviction - a table wide
+ * purge counter. A reply scoped to a serial stays valid while its bucket
+ * and the purge counter are unchanged, any other reply while the table
+ * counter is. Serials sharing a bucket only cost an extra miss.
+ */
+
+#define CACHE_SIZE		16
+#define CACHE_BUCKETS		64
+
+/* larger replies are not worth keeping around */
+#define CACHE_MAX_REPLY		(64 * 1024)
+
+struct cache_entry {
+	int method;
+	struct blob_attr *key;
+	struct blob_attr *reply;
+	uint32_t gen;
+	uint32_t purge;
+	uint32_t serial_gen;
+	int bucket;
+	uint64_t used;
+};
+
+/* the table each cached method reads from */
+static const int cache_tables[__CACHE_METHOD_MAX] = {
+	[CACHE_DEVICE_LIST] = CACHE_TABLE_DEVICE,
+	[CACHE_STATE_LIST] = CACHE_TABLE_STATE,
+	[CACHE_HEALTH_LIST] = CACHE_TABLE_HEALTH,
+	[CACHE_EVENT_LIST] = CACHE_TABLE_EVENT,
+};
+
+static struct {
+	struct cache_entry entry[CACHE_SIZE];
+	uint32_t gen[__CACHE_TABLE_MAX];
+	uint32_t purge[__CACHE_TABLE_MAX];
+	uint32_t serial[__CACHE_TABLE_MAX][CACHE_BUCKETS];
+	uint64_t tick;
+	uint64_t hits;
+	uint64_t misses;
+} cache;
+
+static int
+cache_bucket(const char *serial)
+{
+	uint32_t hash = 5381;
+
+	while (*serial)
+		hash = hash * 33 + *serial++;
+
+	return hash % CACHE_BUCKETS;
+}
+
+void
+cache_bump(int table, const char *serial)
+{
+	cache.gen[table]++;
+
+	if (serial)
+		cache.serial[table][cache_bucket(serial)]++;
+	else
+		cache.purge[table]++;
+}
+
+void
+cache_invalidate(void)
+{
+	int i;
+
+	for (i = 0; i < __CACHE_TABLE_MAX; i++)
+		cache_bump(i, NULL);
+}
+
+static int
+cache_valid(struct cache_entry *e)
+{
+	int table = cache_tables[e->method];
+
+	if (e->bucket < 0)
+		return e->gen == cache.gen[table];
+
+	return e->purge == cache.purge[table] && e->serial_gen == cache.serial[table][e->bucket];
+}
+
+static struct cache_entry *
+cache_find(int method, struct blob_attr *msg)
+{
+	int i;
+
+	for (i = 0; i < CACHE_SIZE; i++) {
+		struct cache_entry *e = &cache.entry[i];
+
+		if (e->reply && e->method == method &&
+		    blob_pad_len(e->key) == blob_pad_len(msg) &&
+		    !memcmp(e->key, msg, blob_pad_len(msg)))
+			return e;
+	}
+
+	return NULL;
+}
+
+static void
+cache_free(struct cache_entry *e)
+{
+	free(e->key);
+	free(e->reply);
+	memset(e, 0, sizeof(*e));
+}
+
+struct blob_attr *
+cache_get(int method, struct blob_attr *msg)
+{
+	struct cache_entry *e;
+
+	if (!config.cache)
+		return NULL;
+
+	e = cache_find(method, msg);
+	if (e && cache_valid(e)) {
+		e->used = ++cache.tick;
+		cache.hits++;
+		return e->reply;
+	}
+
+	if (e)
+		cache_free(e);
+	cache.misses++;
+
+	return NULL;
+}
+
+void
+cache_put(int method, struct blob_attr *msg, const char *serial, struct blob_attr *reply)
+{
+	int table = cache_tables[method];
+	struct cache_entry *e;
+	int i;
+
+	if (!config.cache || blob_pad_len(reply) > CACHE_MAX_REPLY)
+		return;
+
+	/* reuse a stale entry for the same request, otherwise the least recently used one */
+	e = cache_find(method, msg);
+	if (!e) {
+		e = &cache.entry[0];
+		for (i = 1; i < CACHE_SIZE && e->reply; i++)
+			if (!cache.entry[i].reply || cache.entry[i].used < e->used)
+				e = &cache.entry[i];
+	}
+
+	cache_free(e);
+	e->key = blob_memdup(msg);
+	e->reply = blob_memdup(reply);
+	if (!e->key || !e->reply) {
+		cache_free(e);
+		return;
+	}
+
+	e->method = method;
+	e->gen = cache.gen[table];
+	e->purge = cache.purge[table];
+	e->bucket = serial ? cache_bucket(serial) : -1;
+	if (serial)
+		e->serial_gen = cache.serial[table][e->bucket];
+	e->used = ++cache.tick;
+}
+
+void
+cache_stats(struct blob_buf *b)
+{
+	blobmsg_add_u8(b, "enabled", !!config.cache);
+	blobmsg_add_u64(b, "hits", cache.hits);
+	blobmsg_add_u64(b, "misses", cache.misses);
+}
+
+void
+cache_stop(void)
+{
+	int i;
+
+	for (i = 0; i < CACHE_SIZE; i++)
+		cache_free(&cache.entry[i]);
+}
@@ -19,16 +19,113 @@
 
 #include "db.h"
 
+/* a follower only mirrors its primary, everything that would write on its own is off */
+void
+config_follow(char *path)
+{
+	config.follow = path;
+	config.replicate = NULL;
+	config.hot_path = NULL;
+	config.fts = 0;
+	config.max_bytes = 0;
+}
+
 static void
 config_load_global(struct uci_section *s)
 {
 	enum {
 		GLOBAL_ATTR_PATH,
+		GLOBAL_ATTR_EVENT_WINDOW,
+		GLOBAL_ATTR_FTS,
+		GLOBAL_ATTR_STATE_RATE,
+		GLOBAL_ATTR_STATE_BURST,
+		GLOBAL_ATTR_HEALTH_RATE,
+		GLOBAL_ATTR_HEALTH_BURST,
+		GLOBAL_ATTR_EVENT_RATE,
+		GLOBAL_ATTR_EVENT_BURST,
+		GLOBAL_ATTR_BACKUP_PAGES,
+		GLOBAL_ATTR_RESTORE,
+		GLOBAL_ATTR_HOT_PATH,
+		GLOBAL_ATTR_HOT_AGE,
+		GLOBAL_ATTR_HOT_INTERVAL,
+		GLOBAL_ATTR_ATTACH,
+		GLOBAL_ATTR_JOURNAL_MODE,
+		GLOBAL_ATTR_SYNCHRONOUS,
+		GLOBAL_ATTR_CHECKPOINT,
+		GLOBAL_ATTR_STATE_PATH,
+		GLOBAL_ATTR_STATE_SYNCHRONOUS,
+		GLOBAL_ATTR_STATE_CHECKPOINT,
+		GLOBAL_ATTR_HEALTH_PATH,
+		GLOBAL_ATTR_HEALTH_SYNCHRONOUS,
+		GLOBAL_ATTR_HEALTH_CHECKPOINT,
+		GLOBAL_ATTR_EVENT_PATH,
+		GLOBAL_ATTR_EVENT_SYNCHRONOUS,
+		GLOBAL_ATTR_EVENT_CHECKPOINT,
+		GLOBAL_ATTR_TOPK_WINDOW,
+		GLOBAL_ATTR_MAX_BYTES,
+		GLOBAL_ATTR_BUDGET_HIGH,
+		GLOBAL_ATTR_BUDGET_LOW,
+		GLOBAL_ATTR_BUDGET_CHUNK,
+		GLOBAL_ATTR_STATE_WEIGHT,
+		GLOBAL_ATTR_HEALTH_WEIGHT,
+		GLOBAL_ATTR_EVENT_WEIGHT,
+		GLOBAL_ATTR_SQLITE_HEAP,
+		GLOBAL_ATTR_SQLITE_PAGECACHE,
+		GLOBAL_ATTR_LOOKASIDE_SIZE,
+		GLOBAL_ATTR_LOOKASIDE_SLOTS,
+		GLOBAL_ATTR_REPLICATE,
+		GLOBAL_ATTR_FOLLOW,
+		GLOBAL_ATTR_SLOW_QUERY,
+		GLOBAL_ATTR_CACHE,
+		GLOBAL_ATTR_CLUSTERED,
 		__GLOBAL_ATTR_MAX,
 	};
 
 	static const struct blobmsg_policy global_attrs[__GLOBAL_ATTR_MAX] = {
 		[GLOBAL_ATTR_PATH] = { .name = "path", .type = BLOBMSG_TYPE_STRING },
+		[GLOBAL_ATTR_EVENT_WINDOW] = { .name = "event_window", .type = BLOBMSG_TYPE_INT32 },
+		[GLOBAL_ATTR_FTS] = { .name = "fts", .type = BLOBMSG_TYPE_BOOL },
+		[GLOBAL_ATTR_STATE_RATE] = { .name = "state_rate", .type = BLOBMSG_TYPE_INT32 },
+		[GLOBAL_ATTR_STATE_BURST] = { .name = "state_burst", .type = BLOBMSG_TYPE_INT32 },
+		[GLOBAL_ATTR_HEALTH_RATE] = { .name = "health_rate", .type = BLOBMSG_TYPE_INT32 },
+		[GLOBAL_ATTR_HEALTH_BURST] = { .name = "health_burst", .type = BLOBMSG_TYPE_INT32 },
+		[GLOBAL_ATTR_EVENT_RATE] = { .name = "event_rate", .type = BLOBMSG_TYPE_INT32 },
+		[GLOBAL_ATTR_EVENT_BURST] = { .name = "event_burst", .type = BLOBMSG_TYPE_INT32 },
+		[GLOBAL_ATTR_BACKUP_PAGES] = { .name = "backup_pages", .type = BLOBMSG_TYPE_INT32 },
+		[GLOBAL_ATTR_RESTORE] = { .name = "restore", .type = BLOBMSG_TYPE_STRING },
+		[GLOBAL_ATTR_HOT_PATH] = { .name = "hot_path", .type = BLOBMSG_TYPE_STRING },
+		[GLOBAL_ATTR_HOT_AGE] = { .name = "hot_age", .type = BLOBMSG_TYPE_INT32 },
+		[GLOBAL_ATTR_HOT_INTERVAL] = { .name = "hot_interval", .type = BLOBMSG_TYPE_INT32 },
+		[GLOBAL_ATTR_ATTACH] = { .name = "attach", .type = BLOBMSG_TYPE_BOOL },
+		[GLOBAL_ATTR_JOURNAL_MODE] = { .name = "journal_mode", .type = BLOBMSG_TYPE_STRING },
+		[GLOBAL_ATTR_SYNCHRONOUS] = { .name = "synchronous", .type = BLOBMSG_TYPE_INT32 },
+		[GLOBAL_ATTR_CHECKPOINT] = { .name = "checkpoint", .type = BLOBMSG_TYPE_INT32 },
+		[GLOBAL_ATTR_STATE_PATH] = { .name = "state_path", .type = BLOBMSG_TYPE_STRING },
+		[GLOBAL_ATTR_STATE_SYNCHRONOUS] = { .name = "state_synchronous", .type = BLOBMSG_TYPE_INT32 },
+		[GLOBAL_ATTR_STATE_CHECKPOINT] = { .name = "state_checkpoint", .type = BLOBMSG_TYPE_INT32 },
+		[GLOBAL_ATTR_HEALTH_PATH] = { .name = "health_path", .type = BLOBMSG_TYPE_STRING },
+		[GLOBAL_ATTR_HEALTH_SYNCHRONOUS] = { .name = "health_synchronous", .type = BLOBMSG_TYPE_INT32 },
+		[GLOBAL_ATTR_HEALTH_CHECKPOINT] = { .name = "health_checkpoint", .type = BLOBMSG_TYPE_INT32 },
+		[GLOBAL_ATTR_EVENT_PATH] = { .name = "event_path", .type = BLOBMSG_TYPE_STRING },
+		[GLOBAL_ATTR_EVENT_SYNCHRONOUS] = { .name = "event_synchronous", .type = BLOBMSG_TYPE_INT32 },
+		[GLOBAL_ATTR_EVENT_CHECKPOINT] = { .name = "event_checkpoint", .type = BLOBMSG_TYPE_INT32 },
+		[GLOBAL_ATTR_TOPK_WINDOW] = { .name = "topk_window", .type = BLOBMSG_TYPE_INT32 },
+		[GLOBAL_ATTR_MAX_BYTES] = { .name = "max_bytes", .type = BLOBMSG_TYPE_INT32 },
+		[GLOBAL_ATTR_BUDGET_HIGH] = { .name = "budget_high", .type = BLOBMSG_TYPE_INT32 },
+		[GLOBAL_ATTR_BUDGET_LOW] = { .name = "budget_low", .type = BLOBMSG_TYPE_INT32 },
+		[GLOBAL_ATTR_BUDGET_CHUNK] = { .name = "budget_chunk", .type = BLOBMSG_TYPE_INT32 },
+		[GLOBAL_ATTR_STATE_WEIGHT] = { .name = "state_weight", .type = BLOBMSG_TYPE_INT32 },
+		[GLOBAL_ATTR_HEALTH_WEIGHT] = { .name = "health_weight", .type = BLOBMSG_TYPE_INT32 },
+		[GLOBAL_ATTR_EVENT_WEIGHT] = { .name = "event_weight", .type = BLOBMSG_TYPE_INT32 },
+		[GLOBAL_ATTR_SQLITE_HEAP] = { .name = "sqlite_heap", .type = BLOBMSG_TYPE_INT32 },
+		[GLOBAL_ATTR_SQLITE_PAGECACHE] = { .name = "sqlite_pagecache", .type = BLOBMSG_TYPE_INT32 },
+		[GLOBAL_ATTR_LOOKASIDE_SIZE] = { .name = "lookaside_size", .type = BLOBMSG_TYPE_INT32 },
+		[GLOBAL_ATTR_LOOKASIDE_SLOTS] = { .name = "lookaside_slots", .type = BLOBMSG_TYPE_INT32 },
+		[GLOBAL_ATTR_REPLICATE] = { .name = "replicate", .type = BLOBMSG_TYPE_STRING },
+		[GLOBAL_ATTR_FOLLOW] = { .name = "follow", .type = BLOBMSG_TYPE_STRING },
+		[GLOBAL_ATTR_SLOW_QUERY] = { .name = "slow_query", .type = BLOBMSG_TYPE_INT32 },
+		[GLOBAL_ATTR_CACHE] = { .name = "cache", .type = BLOBMSG_TYPE_BOOL },
+		[GLOBAL_ATTR_CLUSTERED] = { .name = "clustered", .type = BLOBMSG_TYPE_BOOL },
 	};
 
 	const struct uci_blob_param_list global_attr_list = {
@@ -37,6 +134,7 @@ config_load_global(struct uci_section *s)
 	};
 
 	struct blob_attr *tb[__GLOBAL_ATTR_MAX] = { 0 };
+	int i;
 
 	blob_buf_init(&b, 0);
 	uci_to_blob(&b, s, &global_attr_list);
@@ -45,22 +143,143 @@ config_load_global(struct uci_section *s)
 	if (tb[GLOBAL_ATTR_PATH])
 		config.db_path = blobmsg_get_string(tb[GLOBAL_ATTR_PATH]);
 
+	if (tb[GLOBAL_ATTR_EVENT_WINDOW])
+		config.event_window = blobmsg_get_u32(tb[GLOBAL_ATTR_EVENT_WINDOW]);
+
+	if (tb[GLOBAL_ATTR_FTS])
+		config.fts = blobmsg_get_bool(tb[GLOBAL_ATTR_FTS]);
+
+	/* rate/burst pairs are laid out in RATELIMIT_* order */
+	for (i = 0; i < __RATELIMIT_MAX; i++) {
+		if (tb[GLOBAL_ATTR_STATE_RATE + 2 * i])
+			config.rate[i] = blobmsg_get_u32(tb[GLOBAL_ATTR_STATE_RATE + 2 * i]);
+		if (tb[GLOBAL_ATTR_STATE_BURST + 2 * i])
+			config.burst[i] = blobmsg_get_u32(tb[GLOBAL_ATTR_STATE_BURST + 2 * i]);
+		if (config.rate[i] && config.burst[i] < 1)
+			config.burst[i] = config.rate[i];
+	}
+
+	if (tb[GLOBAL_ATTR_BACKUP_PAGES] && blobmsg_get_u32(tb[GLOBAL_ATTR_BACKUP_PAGES]))
+		config.backup_pages = blobmsg_get_u32(tb[GLOBAL_ATTR_BACKUP_PAGES]);
+
+	if (tb[GLOBAL_ATTR_RESTORE])
+		config.restore_path = blobmsg_get_string(tb[GLOBAL_ATTR_RESTORE]);
+
+	if (tb[GLOBAL_ATTR_HOT_PATH])
+		config.hot_path = blobmsg_get_string(tb[GLOBAL_ATTR_HOT_PATH]);
+
+	if (tb[GLOBAL_ATTR_HOT_AGE])
+		config.hot_age = blobmsg_get_u32(tb[GLOBAL_ATTR_HOT_AGE]);
+
+	if (tb[GLOBAL_ATTR_HOT_INTERVAL] && blobmsg_get_u32(tb[GLOBAL_ATTR_HOT_INTERVAL]))
+		config.hot_interval = blobmsg_get_u32(tb[GLOBAL_ATTR_HOT_INTERVAL]);
+
+	/* coalesced events get updated in place, they must not move tiers before that */
+	if (config.hot_age < config.event_window)
+		config.hot_age = config.event_window;
+
+	if (tb[GLOBAL_ATTR_ATTACH])
+		config.attach = blobmsg_get_bool(tb[GLOBAL_ATTR_ATTACH]);
+
+	if (tb[GLOBAL_ATTR_JOURNAL_MODE])
+		config.journal_mode = blobmsg_get_string(tb[GLOBAL_ATTR_JOURNAL_MODE]);
+
+	/* path/synchronous/checkpoint triplets are laid out in DB_* order, main has no path */
+	for (i = DB_MAIN; i < __DB_MAX; i++) {
+		int attr = GLOBAL_ATTR_SYNCHRONOUS + 3 * i;
+
+		if (i != DB_MAIN && tb[attr - 1])
+			config.split_path[i] = blobmsg_get_string(tb[attr - 1]);
+		if (tb[attr])
+			config.synchronous[i] = blobmsg_get_u32(tb[attr]);
+		if (tb[attr + 1])
+			config.checkpoint[i] = blobmsg_get_u32(tb[attr + 1]);
+	}
+
+	/* 0 turns the heavy hitter tracking off */
+	if (tb[GLOBAL_ATTR_TOPK_WINDOW])
+		config.topk_window = blobmsg_get_u32(tb[GLOBAL_ATTR_TOPK_WINDOW]);
+
+	if (tb[GLOBAL_ATTR_MAX_BYTES])
+		config.max_bytes = blobmsg_get_u32(tb[GLOBAL_ATTR_MAX_BYTES]);
+
+	if (tb[GLOBAL_ATTR_BUDGET_HIGH])
+		config.budget_high = blobmsg_get_u32(tb[GLOBAL_ATTR_BUDGET_HIGH]);
+
+	if (tb[GLOBAL_ATTR_BUDGET_LOW])
+		config.budget_low = blobmsg_get_u32(tb[GLOBAL_ATTR_BUDGET_LOW]);
+
+	if (tb[GLOBAL_ATTR_BUDGET_CHUNK] && blobmsg_get_u32(tb[GLOBAL_ATTR_BUDGET_CHUNK]))
+		config.budget_chunk = blobmsg_get_u32(tb[GLOBAL_ATTR_BUDGET_CHUNK]);
+
+	/* watermarks are percentages of max_bytes */
+	if (config.budget_high > 100)
+		config.budget_high = 100;
+	if (config.budget_low > config.budget_high)
+		config.budget_low = config.budget_high;
+
+	/* weights are laid out in DB_* order, starting at state */
+	for (i = DB_STATE; i < __DB_MAX; i++)
+		if (tb[GLOBAL_ATTR_STATE_WEIGHT + i - DB_STATE])
+			config.weight[i] = blobmsg_get_u32(tb[GLOBAL_ATTR_STATE_WEIGHT + i - DB_STATE]);
+
+	/* arena sizes, 0 leaves SQLite on the system allocator */
+	if (tb[GLOBAL_ATTR_SQLITE_HEAP])
+		config.sqlite_heap = blobmsg_get_u32(tb[GLOBAL_ATTR_SQLITE_HEAP]);
+
+	if (tb[GLOBAL_ATTR_SQLITE_PAGECACHE])
+		config.sqlite_pagecache = blobmsg_get_u32(tb[GLOBAL_ATTR_SQLITE_PAGECACHE]);
+
+	/* lookaside is only changed when both size and slots are given */
+	if (tb[GLOBAL_ATTR_LOOKASIDE_SIZE])
+		config.lookaside_size = blobmsg_get_u32(tb[GLOBAL_ATTR_LOOKASIDE_SIZE]);
+
+	if (tb[GLOBAL_ATTR_LOOKASIDE_SLOTS])
+		config.lookaside_slots = blobmsg_get_u32(tb[GLOBAL_ATTR_LOOKASIDE_SLOTS]);
+
+	/* socket of the follower changes get shipped to */
+	if (tb[GLOBAL_ATTR_REPLICATE])
+		config.replicate = blobmsg_get_string(tb[GLOBAL_ATTR_REPLICATE]);
+
+	if (tb[GLOBAL_ATTR_FOLLOW])
+		config_follow(blobmsg_get_string(tb[GLOBAL_ATTR_FOLLOW]));
+
+	/* milliseconds a statement may take before it is logged, 0 turns the log off */
+	if (tb[GLOBAL_ATTR_SLOW_QUERY])
+		config.slow_query = blobmsg_get_u32(tb[GLOBAL_ATTR_SLOW_QUERY]);
+
+	if (tb[GLOBAL_ATTR_CACHE])
+		config.cache = blobmsg_get_bool(tb[GLOBAL_ATTR_CACHE]);
+
+	/* state and health rows get stored clustered by device, switching rebuilds the tables */
+	if (tb[GLOBAL_ATTR_CLUSTERED])
+		config.clustered = blobmsg_get_bool(tb[GLOBAL_ATTR_CLUSTERED]);
+
 }
 
+/* confdir and section let a second instance, e.g. a follower, run off its own settings */
 void
-config_load(void)
+config_load(char *confdir, char *section)
 {
 	struct uci_context *uci = uci_alloc_context();
         struct uci_package *package = NULL;
 
+	if (confdir && uci_set_confdir(uci, confdir)) {
+		ulog(LOG_ERR, "failed to set the UCI config dir to %s\n", confdir);
+		exit(EXIT_FAILURE);
+	}
+
 	if (!uci_load(uci, "uCollect", &package)) {
 		struct uci_element *e;
 
 		uci_foreach_element(&package->sections, e) {
 			struct uci_section *s = uci_to_section(e);
 
-			if (!strcmp(s->type, "global"))
-				config_load_global(s);
+			if (strcmp(s->type, "global"))
+				continue;
+			if (section && strcmp(s->e.name, section))
+				continue;
+			config_load_global(s);
 		}
 	} else {
 		ulog(LOG_ERR, "failed to load UCI\n");
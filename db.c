@@ -14,221 +14,222 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <limits.h>
+
 #include "db.h"
 
 struct config config = {
 	.db_path = "/etc/urender/db.sqlite",
+	.backup_pages = 64,
+	.hot_age = 300,
+	.hot_interval = 60,
+	.synchronous = { -1, -1, -1, -1 },
+	.topk_window = 60,
+	.budget_high = 90,
+	.budget_low = 80,
+	.budget_chunk = 500,
+	.weight = { 0, 1, 1, 1 },
+	.cache = 1,
 };
 
 sqlite3 *db;
+sqlite3 *db_handle[__DB_MAX];
 
-#define TABLE_DEVICE							\
-	"CREATE TABLE IF NOT EXISTS device ("				\
-	"serial		VARCHAR(30) UNIQUE PRIMARY KEY NOT NULL,"	\
-	"compatible    	VARCHAR(32) NOT NULL,"				\
-	"created	BIGINT NOT NULL,"				\
-	"modified	BIGINT NOT NULL"				\
-	")"
-
-#define INDEX_DEVICE	"CREATE INDEX IF NOT EXISTS device_index ON device(serial)"
-
-#define TABLE_STATE							\
-	"CREATE TABLE IF NOT EXISTS state ("				\
-	"serial		VARCHAR(30) NOT NULL,"				\
-	"state		BLOB NOT NULL,"					\
-	"timestamp	BIGINT NOT NULL,"				\
-	"FOREIGN KEY(serial) REFERENCES device(serial)"			\
-	")"
-
-#define INDEX_STATE	"CREATE INDEX IF NOT EXISTS state_index ON state(serial)"
-
-#define TABLE_HEALTH							\
-	"CREATE TABLE IF NOT EXISTS health ("				\
-	"serial		VARCHAR(30) NOT NULL,"				\
-	"health		BLOB NOT NULL,"					\
-	"timestamp	BIGINT NOT NULL,"				\
-	"FOREIGN KEY(serial) REFERENCES device(serial)"			\
-	")"
-
-#define INDEX_HEALTH	"CREATE INDEX IF NOT EXISTS health_index ON health(serial)"
-
-#define TABLE_EVENT							\
-	"CREATE TABLE IF NOT EXISTS event ("				\
-	"type		VARCHAR(30) NOT NULL,"				\
-	"serial		VARCHAR(30),"					\
-	"client		VARCHAR(64),"					\
-	"event		TEXT,"						\
-	"timestamp	BIGINT NOT NULL,"				\
-	"FOREIGN KEY(serial) REFERENCES device(serial)"			\
-	")"
-
-#define INDEX_EVENT_TYPE	"CREATE INDEX IF NOT EXISTS event_type_index ON event(type)"
-#define INDEX_EVENT_SERIAL	"CREATE INDEX IF NOT EXISTS event_serial_index ON event(serial)"
-
-#define FOREIGN_KEYS	"PRAGMA foreign_keys = ON"
-
-static char *db_commands[] = {
-	"BEGIN TRANSACTION;",
-	TABLE_DEVICE,
-	INDEX_DEVICE,
-
-	TABLE_STATE,
-	INDEX_STATE,
-
-	TABLE_HEALTH,
-	INDEX_HEALTH,
-
-	TABLE_EVENT,
-	INDEX_EVENT_TYPE,
-	INDEX_EVENT_SERIAL,
-
-	FOREIGN_KEYS,
-
-	"COMMIT;",
-	NULL
+const char * const db_names[__DB_MAX] = {
+	[DB_MAIN] = "main",
+	[DB_STATE] = "state",
+	[DB_HEALTH] = "health",
+	[DB_EVENT] = "event",
 };
 
 static int
-db_create_db(void)
+db_pragma(sqlite3 *h, char *pragma, char *value)
 {
-	char **cmd = db_commands;
+	char sql[128];
 
-	while (*cmd) {
-		int ret = db_exec(*cmd);
-		cmd++;
-		if (ret)
-			return ret;
-	}
+	snprintf(sql, sizeof(sql), "PRAGMA %s = %s;", pragma, value);
 
-	return 0;
+	return db_exec_on(h, sql);
 }
 
-void
-db_stop(void)
+static int
+db_tune(int idx)
 {
-/*	if(config.db_path)
-		free(config.db_path);*/
-	sqlite3_close(db);
-}
+	sqlite3 *h = db_handle[idx];
+	char val[16];
 
-int
-db_start(void)
-{
-	int rc = sqlite3_open(config.db_path, &db);
+	if (config.journal_mode && db_pragma(h, "journal_mode", config.journal_mode))
+		return -1;
 
-	if (rc != SQLITE_OK) {
-		ulog(LOG_ERR, "Cannot open database: %s\n", sqlite3_errmsg(db));
-		sqlite3_close(db);
-		return rc;
+	if (config.synchronous[idx] >= 0) {
+		snprintf(val, sizeof(val), "%d", config.synchronous[idx]);
+		if (db_pragma(h, "synchronous", val))
+			return -1;
 	}
 
-	rc = db_create_db();
-	if (rc)
-		db_stop();
+	if (config.checkpoint[idx]) {
+		snprintf(val, sizeof(val), "%d", config.checkpoint[idx]);
+		if (db_pragma(h, "wal_autocheckpoint", val))
+			return -1;
+	}
 
-	return rc;
+	return 0;
 }
 
-void
-db_purge(int timestamp)
+char *
+db_family_path(char *buf, int len, char *path, int idx)
 {
-	health_purge(timestamp);
-	state_purge(timestamp);
-	event_purge(timestamp);
+	/* files belonging to a split off family get its name appended */
+	if (idx == DB_MAIN || db_handle[idx] == db || !strcmp(path, ":memory:"))
+		snprintf(buf, len, "%s", path);
+	else
+		snprintf(buf, len, "%s.%s", path, db_names[idx]);
+
+	return buf;
 }
 
-int
-db_select(sqlite3_stmt *stmt, struct blob_buf *b, int (*cb)(struct blob_buf *b, sqlite3_stmt *stmt))
+static int
+db_open(int idx, char *path)
 {
-	void *c;
+	sqlite3 **h = &db_handle[idx];
+	int rc = sqlite3_open(path, h);
 
-	blob_buf_init(b, 0);
+	if (rc != SQLITE_OK) {
+		ulog(LOG_ERR, "Cannot open database %s: %s\n", path, sqlite3_errmsg(*h));
+		sqlite3_close(*h);
+		*h = NULL;
+		return rc;
+	}
 
-	c = blobmsg_open_array(b, "rows");
-	while (sqlite3_step(stmt) == SQLITE_ROW)
-		cb(b, stmt);
-	blobmsg_close_array(b, c);
+	if (config.restore_path) {
+		char restore[PATH_MAX];
 
-	sqlite3_finalize(stmt);
+		rc = backup_restore(*h, db_family_path(restore, sizeof(restore), config.restore_path, idx));
+		if (rc)
+			return rc;
+	}
 
-	return 0;
+	rc = blobstore_init(*h);
+	if (!rc)
+		rc = db_schema(idx);
+	if (!rc)
+		rc = db_tune(idx);
+	if (!rc)
+		rc = budget_prepare(*h);
+
+	return rc;
 }
 
-int
-__db_bind_text(sqlite3_stmt *stmt, char *id, char *value, const char *func, const int line)
+static int
+db_attach(int idx)
 {
-	int idx = sqlite3_bind_parameter_index(stmt, id);
+	sqlite3_stmt *stmt;
+	char name[16];
+	char sql[64];
 	int rc;
 
-	if (value)
-		rc = sqlite3_bind_text(stmt, idx, value, strlen(value), NULL);
-	else
-		rc = sqlite3_bind_null(stmt, idx);
+	snprintf(name, sizeof(name), "%s_db", db_names[idx]);
+	snprintf(sql, sizeof(sql), "ATTACH DATABASE @path AS %s", name);
 
-	if (rc != SQLITE_OK) {
-		ulog(LOG_ERR, "SQL error (%s:%d): (%d) - %s\n", func, line, rc, sqlite3_errmsg(db));
-		sqlite3_finalize(stmt);
-		return -1;
-	}
+	db_prepare(rc, stmt, sql);
 
-	return 0;
+	db_bind_text(stmt, "@path", config.split_path[idx]);
+
+	return db_insert(stmt);
 }
 
-int
-__db_bind_int64(sqlite3_stmt *stmt, char *id, uint64_t value, const char *func, const int line)
+void
+db_stop(void)
 {
-	int idx = sqlite3_bind_parameter_index(stmt, id);
-	int rc = sqlite3_bind_int64(stmt, idx, value);
+	int i;
 
-	if (rc != SQLITE_OK) {
-		ulog(LOG_ERR, "SQL error (%s:%d): (%d) - %s\n", func, line, rc, sqlite3_errmsg(db));
-		sqlite3_finalize(stmt);
-		return -1;
+/*	if(config.db_path)
+		free(config.db_path);*/
+	backup_stop();
+	export_stop();
+	budget_stop();
+	if (db)
+		device_seen_flush();
+	event_coalesce_flush(1);
+	tier_stop();
+	repl_stop();
+
+	for (i = __DB_MAX - 1; i >= 0; i--) {
+		if (i != DB_MAIN && db_handle[i] == db)
+			continue;
+		sqlite3_close(db_handle[i]);
 	}
-
-	return 0;
+	memset(db_handle, 0, sizeof(db_handle));
+	db = NULL;
 }
 
 int
-__db_bind_blob(sqlite3_stmt *stmt, char *id, struct blob_attr *attr, const char *func, const int line)
+db_start(void)
 {
-	int idx = sqlite3_bind_parameter_index(stmt, id);
-	int rc = sqlite3_bind_blob(stmt, idx, blobmsg_data(attr), blob_pad_len(attr), SQLITE_STATIC);
+	int rc, i;
 
-	if (rc != SQLITE_OK) {
-		ulog(LOG_ERR, "SQL error (%s:%d): (%d) - %s\n", func, line, rc, sqlite3_errmsg(db));
-		sqlite3_finalize(stmt);
-		return -1;
+	/* arenas have to be in place before the first connection is opened */
+	mem_setup();
+
+	rc = db_open(DB_MAIN, config.db_path);
+	db = db_handle[DB_MAIN];
+	if (rc) {
+		db_stop();
+		return rc;
 	}
 
-	return 0;
-}
+	/* families without a file of their own share the main connection */
+	for (i = DB_MAIN + 1; i < __DB_MAX && !rc; i++) {
+		if (!config.split_path[i]) {
+			db_handle[i] = db;
+			continue;
+		}
 
-int
-__db_simple(sqlite3_stmt *stmt, const char *func, const int line)
-{
-	int rc = sqlite3_step(stmt);
+		rc = db_open(i, config.split_path[i]);
+		if (!rc && config.attach)
+			rc = db_attach(i);
+	}
 
-	if (rc != SQLITE_DONE)
-		ulog(LOG_ERR, "SQL error (%s:%d): (%d) - %s\n", func, line, rc, sqlite3_errmsg(db));
-	sqlite3_finalize(stmt);
+	if (!rc)
+		rc = db_fts(db_event);
+	if (!rc)
+		rc = tier_start();
+	if (!rc)
+		rc = repl_start();
+	if (rc)
+		db_stop();
+	else
+		budget_start();
+
+	return rc;
+}
 
-	return rc != SQLITE_DONE;
+void
+db_purge(int64_t timestamp)
+{
+	health_purge(timestamp);
+	state_purge(timestamp);
+	event_purge(timestamp);
 }
 
 int
-__db_exec(char *sql, const char *func, const int line)
+db_select(sqlite3_stmt *stmt, struct blob_buf *b, int (*cb)(struct blob_buf *b, sqlite3_stmt *stmt))
 {
-	char *err_msg = 0;
-	int rc;
+	int64_t start = slowlog_now();
+	int rows = 0;
+	void *c;
 
-	rc = sqlite3_exec(db, sql, 0, 0, &err_msg);
+	blob_buf_init(b, 0);
 
-	if (rc != SQLITE_OK) {
-		ulog(LOG_ERR, "SQL error (%s:%d): %s\n", func, line, err_msg);
-		sqlite3_free(err_msg);
+	c = blobmsg_open_array(b, "rows");
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		cb(b, stmt);
+		rows++;
 	}
+	blobmsg_close_array(b, c);
 
-	return rc;
-}
+	slowlog_record(stmt, __func__, start, rows);
+	sqlite3_finalize(stmt);
 
+	return 0;
+}
@@ -20,35 +20,160 @@
 #include <stdint.h>
 
 #include <libubox/blobmsg.h>
+#include <libubox/utils.h>
 #include <libubox/ulog.h>
 
+enum {
+	DB_MAIN,
+	DB_STATE,
+	DB_HEALTH,
+	DB_EVENT,
+	__DB_MAX,
+};
+
+enum {
+	RATELIMIT_STATE,
+	RATELIMIT_HEALTH,
+	RATELIMIT_EVENT,
+	__RATELIMIT_MAX,
+};
+
+enum {
+	TOPK_STATE,
+	TOPK_HEALTH,
+	TOPK_EVENT,
+	TOPK_EVENT_TYPE,
+	__TOPK_MAX,
+};
+
+enum {
+	CACHE_TABLE_DEVICE,
+	CACHE_TABLE_STATE,
+	CACHE_TABLE_HEALTH,
+	CACHE_TABLE_EVENT,
+	__CACHE_TABLE_MAX,
+};
+
+enum {
+	CACHE_DEVICE_LIST,
+	CACHE_STATE_LIST,
+	CACHE_HEALTH_LIST,
+	CACHE_EVENT_LIST,
+	__CACHE_METHOD_MAX,
+};
+
 struct config {
 	char *db_path;
+	int event_window;
+	int fts;
+	int rate[__RATELIMIT_MAX];
+	int burst[__RATELIMIT_MAX];
+	int backup_pages;
+	char *restore_path;
+	char *hot_path;
+	int hot_age;
+	int hot_interval;
+	char *split_path[__DB_MAX];
+	int attach;
+	char *journal_mode;
+	int synchronous[__DB_MAX];
+	int checkpoint[__DB_MAX];
+	int topk_window;
+	unsigned int max_bytes;
+	int budget_high;
+	int budget_low;
+	int budget_chunk;
+	int weight[__DB_MAX];
+	unsigned int sqlite_heap;
+	int sqlite_pagecache;
+	int lookaside_size;
+	int lookaside_slots;
+	char *replicate;
+	char *follow;
+	unsigned int slow_query;
+	int cache;
+	int clustered;
 };
 
-extern void config_load(void);
+extern void config_load(char *confdir, char *section);
+extern void config_follow(char *path);
 
 extern struct blob_buf b;
 
 extern struct config config;
 
+extern int ratelimit_check(char *serial, int method);
+extern void ratelimit_stats(struct blob_buf *b);
+
+extern void topk_add(int stream, char *key);
+extern void topk_dump(struct blob_buf *b, int limit);
+
+extern int budget_prepare(sqlite3 *h);
+extern void budget_start(void);
+extern void budget_stop(void);
+extern void budget_status(struct blob_buf *b);
+
+extern void mem_setup(void);
+extern void mem_stats(struct blob_buf *b);
+
+/* writes bump the generation of what they touch, serial NULL for writes spanning all serials */
+extern void cache_bump(int table, const char *serial);
+extern void cache_invalidate(void);
+extern struct blob_attr *cache_get(int method, struct blob_attr *msg);
+extern void cache_put(int method, struct blob_attr *msg, const char *serial, struct blob_attr *reply);
+extern void cache_stats(struct blob_buf *b);
+extern void cache_stop(void);
+
+extern int64_t slowlog_now(void);
+extern void slowlog_record(sqlite3_stmt *stmt, const char *func, int64_t start, int rows);
+extern void slowlog_dump(struct blob_buf *b, int clear);
+
+extern int repl_start(void);
+extern void repl_stop(void);
+extern void repl_status(struct blob_buf *b);
+
+extern int tier_start(void);
+extern void tier_stop(void);
+extern void tier_flush(int all);
+
+extern int backup_start(char *path);
+extern void backup_stop(void);
+extern void backup_status(struct blob_buf *b);
+extern int backup_restore(sqlite3 *h, char *path);
+
+extern int export_serial(char *path, int json, char *serial, int64_t from, int64_t to);
+extern void export_stop(void);
+extern void export_status(struct blob_buf *b);
+
 extern void ubus_startup(void);
 extern void ubus_stop(void);
 
 extern sqlite3 *db;
 extern int db_start(void);
 extern void db_stop(void);
-extern void db_purge(int timestamp);
+extern void db_purge(int64_t timestamp);
+extern char *db_family_path(char *buf, int len, char *path, int idx);
 extern int db_select(sqlite3_stmt *stmt, struct blob_buf *b, int (*cb)(struct blob_buf *b, sqlite3_stmt *stmt));
+extern int db_schema(int idx);
+extern int db_fts(sqlite3 *h);
+
+/* state, health and event can each live in a file of their own, by default they alias db */
+extern sqlite3 *db_handle[__DB_MAX];
+extern const char * const db_names[__DB_MAX];
+#define db_state	db_handle[DB_STATE]
+#define db_health	db_handle[DB_HEALTH]
+#define db_event	db_handle[DB_EVENT]
 
 /* making this a causes a SQLITE_MISUSE ?! */
-#define db_prepare(rc, stmt, sql)										\
-	rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);								\
+#define db_prepare_on(h, rc, stmt, sql)										\
+	rc = sqlite3_prepare_v2(h, sql, -1, &stmt, 0);								\
 	if (rc != SQLITE_OK) {											\
-		fprintf(stderr, "SQL error (%s:%d): (%d) - %s\n", __func__, __LINE__, rc, sqlite3_errmsg(db));	\
+		fprintf(stderr, "SQL error (%s:%d): (%d) - %s\n", __func__, __LINE__, rc, sqlite3_errmsg(h));	\
 		return -1;											\
 	}													\
 
+#define db_prepare(rc, stmt, sql) db_prepare_on(db, rc, stmt, sql)
+
 extern int __db_bind_text(sqlite3_stmt *stmt, char *id, char *value, const char *func, const int line);
 #define db_bind_text(x, y, z)					\
 	if (__db_bind_text(x, y, z, __func__, __LINE__))	\
@@ -68,27 +193,56 @@ extern int __db_simple(sqlite3_stmt *stmt, const char *func, const int line);
 #define db_insert(x) __db_simple(x, __func__, __LINE__)
 #define db_delete(x) __db_simple(x, __func__, __LINE__)
 
-extern int __db_exec(char *sql, const char *func, const int line);
-#define db_exec(x) __db_exec(x, __func__, __LINE__)
+extern int __db_exec(sqlite3 *h, char *sql, const char *func, const int line);
+#define db_exec(x) __db_exec(db, x, __func__, __LINE__)
+#define db_exec_on(h, x) __db_exec(h, x, __func__, __LINE__)
+
+#define __db_str(x)	#x
+#define db_str(x)	__db_str(x)
+
+/* width in seconds of the event_counter time buckets */
+#define EVENT_COUNT_BUCKET	60
+
+/* schema new state/health/event rows are written to */
+#define DB_INGEST	(config.hot_path ? "hot" : "main")
+
+/* fmt carries a %s for the schema and is run against every tier */
+extern int __db_tier_delete(sqlite3 *h, char *fmt, char *serial, int64_t timestamp, const char *func, const int line);
+#define db_tier_delete(h, x, y, z) __db_tier_delete(h, x, y, z, __func__, __LINE__)
 
 typedef int (*sqlite3_callback)(void *b, int, char**, char**);
 
 extern int device_add(char *serial, char *compat);
 extern int device_remove(char *serial);
-extern int device_list(struct blob_buf *b);
+extern int device_list(struct blob_buf *b, int64_t stale, int64_t since);
+extern void device_seen(char *serial);
+extern int device_seen_flush(void);
+extern int device_compatible(char *serial, char *compat, int len);
+extern int device_timeline(struct blob_buf *b, char *serial, int64_t from, int64_t to, int rows, int offset);
+
+extern int blobstore_init(sqlite3 *h);
+extern int blobstore_insert(sqlite3 *h, char *table, char *serial, struct blob_attr *attr);
 
 extern int state_add(char *serial, struct blob_attr *b);
+extern int state_list_cb(struct blob_buf *b, sqlite3_stmt *stmt);
 extern int state_list(struct blob_buf *b, char *serial, int rows);
 extern int state_remove_serial(char *serial);
-extern int state_purge(int timestamp);
+extern int state_purge(int64_t timestamp);
 
 extern int health_add(char *serial, struct blob_attr *b);
+extern int health_list_cb(struct blob_buf *b, sqlite3_stmt *stmt);
 extern int health_list(struct blob_buf *b, char *serial, int rows);
 extern int health_remove_serial(char *serial);
-extern int health_purge(int timestamp);
+extern int health_purge(int64_t timestamp);
 
-extern int event_add(char *type, char *serial, char *client, char *event);
+extern int event_add(char *type, char *serial, char *client, struct blob_attr *event);
+extern int event_list_cb(struct blob_buf *b, sqlite3_stmt *stmt);
 extern int event_list(struct blob_buf *b, char *type, char *serial, char *client, int rows);
+extern int event_search(struct blob_buf *b, char *query, char *type, char *serial,
+			int64_t from, int64_t to, int rows, int offset);
+extern int event_count(struct blob_buf *b, char *type, char *serial,
+		       int64_t from, int64_t to, int histogram);
 extern int event_remove_serial(char *serial);
-extern int event_purge(int timestamp);
+extern int event_purge(int64_t timestamp);
+extern void event_coalesce_flush(int all);
 
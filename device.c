@@ -16,12 +16,167 @@
 
 #include <time.h>
 
+#include <libubox/avl.h>
+#include <libubox/avl-cmp.h>
+#include <libubox/uloop.h>
+
 #include "db.h"
 
+/*
+ * Every add, modify and remove stamps the device with the next value of
+ * a sequence that spans the device and device_tombstone tables, so
+ * device_list can hand out only what changed since a given value.
+ */
+#define DEVICE_SEQ_NEXT									\
+	"(SELECT IFNULL(MAX(seq), 0) + 1 FROM (SELECT MAX(seq) AS seq FROM device "	\
+	"UNION ALL SELECT MAX(seq) FROM device_tombstone))"
+
+/* last_seen updates are collected here and written back in one transaction, they do not bump seq */
+#define DEVICE_SEEN_INTERVAL	30
+
+struct device_seen {
+	struct avl_node avl;
+	int64_t last_seen;
+};
+
+static void device_seen_cb(struct uloop_timeout *t);
+
+static AVL_TREE(device_seen_tree, avl_strcmp, false, NULL);
+static struct uloop_timeout device_seen_timeout = {
+	.cb = device_seen_cb,
+};
+static int64_t device_stale;
+
+void
+device_seen(char *serial)
+{
+	struct device_seen *seen;
+	char *_serial;
+
+	if (!serial)
+		return;
+
+	seen = avl_find_element(&device_seen_tree, serial, seen, avl);
+	if (!seen) {
+		seen = calloc_a(sizeof(*seen), &_serial, strlen(serial) + 1);
+		if (!seen)
+			return;
+
+		seen->avl.key = strcpy(_serial, serial);
+		avl_insert(&device_seen_tree, &seen->avl);
+	}
+	seen->last_seen = time(NULL);
+
+	if (!device_seen_timeout.pending)
+		uloop_timeout_set(&device_seen_timeout, DEVICE_SEEN_INTERVAL * 1000);
+}
+
+static int64_t
+device_seen_get(const char *serial)
+{
+	struct device_seen *seen;
+
+	seen = avl_find_element(&device_seen_tree, serial, seen, avl);
+
+	return seen ? seen->last_seen : 0;
+}
+
+/* the statement is shared by the whole flush, so the binds must not finalize it like db_bind_* does */
+static int
+device_seen_update(sqlite3_stmt *stmt, struct device_seen *seen)
+{
+	if (sqlite3_bind_text(stmt, sqlite3_bind_parameter_index(stmt, "@serial"),
+			      seen->avl.key, -1, SQLITE_STATIC) != SQLITE_OK ||
+	    sqlite3_bind_int64(stmt, sqlite3_bind_parameter_index(stmt, "@last_seen"),
+			       seen->last_seen) != SQLITE_OK ||
+	    sqlite3_step(stmt) != SQLITE_DONE) {
+		ulog(LOG_ERR, "SQL error (%s:%d): %s\n", __func__, __LINE__, sqlite3_errmsg(db));
+		return -1;
+	}
+
+	return sqlite3_reset(stmt) != SQLITE_OK;
+}
+
 int
-device_add(char *serial, char *compat)
+device_seen_flush(void)
+{
+	char *sql = "UPDATE device SET last_seen = @last_seen WHERE serial = @serial";
+	struct device_seen *seen, *tmp;
+	sqlite3_stmt *stmt;
+	int rc;
+
+	uloop_timeout_cancel(&device_seen_timeout);
+
+	if (avl_is_empty(&device_seen_tree))
+		return 0;
+
+	rc = db_exec("BEGIN TRANSACTION;");
+	if (rc)
+		return rc;
+
+	rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+	if (rc == SQLITE_OK) {
+		avl_for_each_element(&device_seen_tree, seen, avl)
+			if ((rc = device_seen_update(stmt, seen)))
+				break;
+		sqlite3_finalize(stmt);
+	} else {
+		ulog(LOG_ERR, "SQL error (%s:%d): %s\n", __func__, __LINE__, sqlite3_errmsg(db));
+	}
+
+	if (rc) {
+		db_exec("ROLLBACK;");
+		uloop_timeout_set(&device_seen_timeout, DEVICE_SEEN_INTERVAL * 1000);
+		return -1;
+	}
+
+	rc = db_exec("COMMIT;");
+	if (rc)
+		return rc;
+
+	/* the table is authoritative again, only newer updates need to be kept around */
+	avl_remove_all_elements(&device_seen_tree, seen, avl, tmp)
+		free(seen);
+
+	/*
+	 * ingest does not bump the cache, a cached device_list may report a
+	 * last_seen up to DEVICE_SEEN_INTERVAL old until the next flush
+	 */
+	cache_bump(CACHE_TABLE_DEVICE, NULL);
+
+	return 0;
+}
+
+static void
+device_seen_cb(struct uloop_timeout *t)
+{
+	device_seen_flush();
+}
+
+static int
+device_serial_exec(char *sql, char *serial)
+{
+	sqlite3_stmt *stmt = NULL;
+	int rc;
+
+	db_prepare(rc, stmt, sql);
+
+	db_bind_text(stmt, "@serial", serial);
+
+	return db_insert(stmt);
+}
+
+static int
+device_upsert(char *serial, char *compat)
 {
-	static char *sql = "INSERT INTO device (serial, compatible, created, modified) VALUES(@serial, @compat, @created, @modified)";
+	/*
+	 * a known serial only gets updated when its compatible differs, adding
+	 * it again unchanged is still an error like the plain INSERT it replaced
+	 */
+	static char *sql = "INSERT INTO device (serial, compatible, created, modified, last_seen, seq) "
+		"VALUES(@serial, @compat, @created, @modified, @modified, " DEVICE_SEQ_NEXT ") "
+		"ON CONFLICT(serial) DO UPDATE SET compatible = excluded.compatible, "
+		"modified = excluded.modified, seq = excluded.seq WHERE compatible != excluded.compatible";
 	sqlite3_stmt *stmt = NULL;
 	int rc;
 
@@ -32,49 +187,180 @@ device_add(char *serial, char *compat)
 	db_bind_int64(stmt, "@created", time(NULL));
 	db_bind_int64(stmt, "@modified", time(NULL));
 
-	return db_insert(stmt);
+	rc = db_insert(stmt);
+	if (!rc && !sqlite3_changes(db)) {
+		ulog(LOG_INFO, "device %s already exists\n", serial);
+		rc = -1;
+	}
+
+	return rc;
+}
+
+int
+device_add(char *serial, char *compat)
+{
+	int rc;
+
+	cache_bump(CACHE_TABLE_DEVICE, serial);
+
+	rc = db_exec("BEGIN TRANSACTION;");
+	if (rc)
+		return rc;
+
+	rc = device_upsert(serial, compat);
+	if (!rc)
+		rc = device_serial_exec("DELETE FROM device_tombstone WHERE serial = @serial", serial);
+
+	if (rc) {
+		db_exec("ROLLBACK;");
+		return -1;
+	}
+
+	return db_exec("COMMIT;");
 }
 
 int
 device_remove(char *serial)
 {
+	char *tombstone = "INSERT OR REPLACE INTO device_tombstone (serial, seq) "
+		"SELECT serial, " DEVICE_SEQ_NEXT " FROM device WHERE serial = @serial";
 	char *sql = "DELETE FROM device WHERE serial = @serial";
-	sqlite3_stmt *stmt = NULL;
 	int rc;
 
+	cache_bump(CACHE_TABLE_DEVICE, serial);
 	state_remove_serial(serial);
 	health_remove_serial(serial);
 	event_remove_serial(serial);
 
+	rc = db_exec("BEGIN TRANSACTION;");
+	if (rc)
+		return rc;
+
+	rc = device_serial_exec(tombstone, serial);
+	if (!rc)
+		rc = device_serial_exec(sql, serial);
+
+	if (rc) {
+		db_exec("ROLLBACK;");
+		return -1;
+	}
+
+	return db_exec("COMMIT;");
+}
+
+int
+device_compatible(char *serial, char *compat, int len)
+{
+	char *sql = "SELECT compatible FROM device WHERE serial = @serial";
+	sqlite3_stmt *stmt;
+	int rc;
+
 	db_prepare(rc, stmt, sql);
 
 	db_bind_text(stmt, "@serial", serial);
 
-	return db_delete(stmt);
+	rc = sqlite3_step(stmt);
+	if (rc == SQLITE_ROW)
+		snprintf(compat, len, "%s", sqlite3_column_text(stmt, 0));
+	sqlite3_finalize(stmt);
+
+	return rc != SQLITE_ROW;
 }
 
 static int
 device_list_cb(struct blob_buf *b, sqlite3_stmt *stmt)
 {
-	void *c = blobmsg_open_table(b, NULL);
+	int64_t last_seen = sqlite3_column_int64(stmt, 4);
+	int64_t pending = device_seen_get((const char *) sqlite3_column_text(stmt, 0));
+	void *c;
+
+	/* updates that did not hit the table yet are newer than what it holds */
+	if (pending > last_seen)
+		last_seen = pending;
 
+	if (device_stale && last_seen >= device_stale)
+		return 0;
+
+	c = blobmsg_open_table(b, NULL);
 	blobmsg_add_string(b, "serial", sqlite3_column_text(stmt, 0));
 	blobmsg_add_string(b, "compatible", sqlite3_column_text(stmt, 1));
-	blobmsg_add_u64(b, "created", sqlite3_column_int(stmt, 2));
-	blobmsg_add_u64(b, "modified", sqlite3_column_int(stmt, 3));
+	blobmsg_add_u64(b, "created", sqlite3_column_int64(stmt, 2));
+	blobmsg_add_u64(b, "modified", sqlite3_column_int64(stmt, 3));
+	blobmsg_add_u64(b, "last_seen", last_seen);
+	blobmsg_add_u64(b, "seq", sqlite3_column_int64(stmt, 5));
 	blobmsg_close_array(b, c);
 
 	return 0;
 }
 
-int
-device_list(struct blob_buf *b)
+static int
+device_list_removed(struct blob_buf *b, int64_t since)
 {
-	char *sql = "SELECT serial, compatible, created, modified FROM device ORDER BY serial;";
+	char *sql = "SELECT serial, seq FROM device_tombstone WHERE seq > @since ORDER BY seq;";
 	sqlite3_stmt *stmt;
+	void *c, *d;
 	int rc;
 
 	db_prepare(rc, stmt, sql);
 
-	return db_select(stmt, b, device_list_cb);
+	db_bind_int64(stmt, "@since", since);
+
+	c = blobmsg_open_array(b, "removed");
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		d = blobmsg_open_table(b, NULL);
+		blobmsg_add_string(b, "serial", sqlite3_column_text(stmt, 0));
+		blobmsg_add_u64(b, "seq", sqlite3_column_int64(stmt, 1));
+		blobmsg_close_table(b, d);
+	}
+	blobmsg_close_array(b, c);
+
+	sqlite3_finalize(stmt);
+
+	return 0;
+}
+
+static int
+device_list_seq(struct blob_buf *b)
+{
+	char *sql = "SELECT " DEVICE_SEQ_NEXT " - 1;";
+	sqlite3_stmt *stmt;
+	int rc;
+
+	db_prepare(rc, stmt, sql);
+
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+		blobmsg_add_u64(b, "seq", sqlite3_column_int64(stmt, 0));
+	sqlite3_finalize(stmt);
+
+	return 0;
+}
+
+int
+device_list(struct blob_buf *b, int64_t stale, int64_t since)
+{
+	char *sql_all = "SELECT serial, compatible, created, modified, last_seen, seq FROM device "
+		"WHERE @stale = 0 OR IFNULL(last_seen, 0) < @stale ORDER BY serial;";
+	char *sql_since = "SELECT serial, compatible, created, modified, last_seen, seq FROM device "
+		"WHERE seq > @since AND (@stale = 0 OR IFNULL(last_seen, 0) < @stale) ORDER BY seq;";
+	sqlite3_stmt *stmt;
+	int rc;
+
+	db_prepare(rc, stmt, since ? sql_since : sql_all);
+
+	db_bind_int64(stmt, "@stale", stale);
+	if (since) {
+		db_bind_int64(stmt, "@since", since);
+	}
+
+	device_stale = stale;
+
+	rc = db_select(stmt, b, device_list_cb);
+
+	/* without the removals a delta is useless, a full listing does not need them */
+	if (!rc && since)
+		rc = device_list_removed(b, since);
+	if (!rc)
+		rc = device_list_seq(b);
+
+	return rc;
 }
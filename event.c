@@ -16,41 +16,385 @@
 
 #include <time.h>
 
+#include <libubox/avl.h>
+#include <libubox/uloop.h>
+
 #include "db.h"
 
-int
-event_add(char *type, char *serial, char *client, char *event)
+/*
+ * Repeats of an event inside config.event_window are not written to the
+ * database. The first occurrence is inserted right away, further ones only
+ * bump last_seen/count in memory and get folded into the row by a single
+ * UPDATE once the window closes.
+ */
+struct event_coalesce {
+	struct avl_node avl;
+	struct list_head list;
+
+	uint32_t hash;
+	char *type;
+	char *serial;
+	char *client;
+	char *event;
+
+	sqlite3_int64 rowid;
+	time_t first_seen;
+	time_t last_seen;
+	unsigned int count;
+};
+
+static int event_coalesce_cmp(const void *k1, const void *k2, void *ptr);
+static void event_coalesce_timeout_cb(struct uloop_timeout *t);
+
+static AVL_TREE(event_coalesce_tree, event_coalesce_cmp, false, NULL);
+static LIST_HEAD(event_coalesce_list);
+static struct uloop_timeout event_coalesce_timeout = {
+	.cb = event_coalesce_timeout_cb,
+};
+
+static int
+event_strcmp(const char *s1, const char *s2)
+{
+	if (!s1 || !s2)
+		return !!s1 - !!s2;
+
+	return strcmp(s1, s2);
+}
+
+static uint32_t
+event_hash(uint32_t hash, const char *str)
+{
+	/* FNV-1a, NULL and "" hash differently thanks to the separator */
+	if (str)
+		while (*str)
+			hash = (hash ^ (uint8_t) *str++) * 16777619;
+
+	return (hash ^ (str ? 0xff : 0xfe)) * 16777619;
+}
+
+static uint32_t
+event_coalesce_hash(struct event_coalesce *ev)
+{
+	uint32_t hash = 2166136261u;
+
+	hash = event_hash(hash, ev->type);
+	hash = event_hash(hash, ev->serial);
+	hash = event_hash(hash, ev->client);
+
+	return event_hash(hash, ev->event);
+}
+
+static int
+event_coalesce_cmp(const void *k1, const void *k2, void *ptr)
+{
+	const struct event_coalesce *e1 = k1, *e2 = k2;
+	int ret;
+
+	if (e1->hash != e2->hash)
+		return e1->hash < e2->hash ? -1 : 1;
+
+	ret = event_strcmp(e1->type, e2->type);
+	if (!ret)
+		ret = event_strcmp(e1->serial, e2->serial);
+	if (!ret)
+		ret = event_strcmp(e1->client, e2->client);
+	if (!ret)
+		ret = event_strcmp(e1->event, e2->event);
+
+	return ret;
+}
+
+static struct event_coalesce *
+event_coalesce_find(const char *type, const char *serial, const char *client, const char *event)
+{
+	struct event_coalesce key = {
+		.type = (char *) type,
+		.serial = (char *) serial,
+		.client = (char *) client,
+		.event = (char *) event,
+	};
+	struct event_coalesce *ev;
+
+	key.hash = event_coalesce_hash(&key);
+
+	return avl_find_element(&event_coalesce_tree, &key, ev, avl);
+}
+
+static void
+event_coalesce_track(char *type, char *serial, char *client, char *event,
+		     sqlite3_int64 rowid, time_t now)
+{
+	struct event_coalesce *ev;
+	char *_type, *_serial, *_client, *_event;
+
+	ev = calloc_a(sizeof(*ev),
+		      &_type, strlen(type) + 1,
+		      &_serial, serial ? strlen(serial) + 1 : 0,
+		      &_client, client ? strlen(client) + 1 : 0,
+		      &_event, event ? strlen(event) + 1 : 0);
+	if (!ev)
+		return;
+
+	ev->type = strcpy(_type, type);
+	if (serial)
+		ev->serial = strcpy(_serial, serial);
+	if (client)
+		ev->client = strcpy(_client, client);
+	if (event)
+		ev->event = strcpy(_event, event);
+
+	ev->hash = event_coalesce_hash(ev);
+	ev->rowid = rowid;
+	ev->first_seen = ev->last_seen = now;
+	ev->avl.key = ev;
+
+	if (avl_insert(&event_coalesce_tree, &ev->avl)) {
+		free(ev);
+		return;
+	}
+	list_add_tail(&ev->list, &event_coalesce_list);
+
+	if (!event_coalesce_timeout.pending)
+		uloop_timeout_set(&event_coalesce_timeout, config.event_window * 1000);
+}
+
+static void
+event_coalesce_free(struct event_coalesce *ev)
+{
+	avl_delete(&event_coalesce_tree, &ev->avl);
+	list_del(&ev->list);
+	free(ev);
+}
+
+/* counters live next to the rows they count and move between tiers with them */
+static int
+event_counter_add(char *type, char *serial, time_t timestamp, unsigned int count)
 {
-	char *sql = "INSERT INTO event (type, serial, client, event, timestamp) VALUES(@type, @serial, @client, @event, @timestamp)";
 	sqlite3_stmt *stmt;
+	char sql[256];
 	int rc;
 
-	db_prepare(rc, stmt, sql);
+	snprintf(sql, sizeof(sql),
+		 "INSERT INTO %s.event_counter (type, serial, bucket, count) VALUES(@type, IFNULL(@serial, ''), @bucket, @count) "
+		 "ON CONFLICT(type, serial, bucket) DO UPDATE SET count = count + excluded.count",
+		 DB_INGEST);
+
+	db_prepare_on(db_event, rc, stmt, sql);
+
+	db_bind_text(stmt, "@type", type);
+	db_bind_text(stmt, "@serial", serial);
+	db_bind_int64(stmt, "@bucket", timestamp - timestamp % EVENT_COUNT_BUCKET);
+	db_bind_int64(stmt, "@count", count);
+
+	return db_insert(stmt);
+}
+
+static int
+event_coalesce_update(struct event_coalesce *ev)
+{
+	sqlite3_stmt *stmt;
+	char sql[128];
+	int rc;
+
+	cache_bump(CACHE_TABLE_EVENT, ev->serial);
+
+	snprintf(sql, sizeof(sql),
+		 "UPDATE %s.event SET last_seen = @last_seen, count = count + @count WHERE rowid = @rowid",
+		 DB_INGEST);
+
+	db_prepare_on(db_event, rc, stmt, sql);
+
+	db_bind_int64(stmt, "@last_seen", ev->last_seen);
+	db_bind_int64(stmt, "@count", ev->count);
+	db_bind_int64(stmt, "@rowid", ev->rowid);
+
+	rc = db_insert(stmt);
+
+	/* the repeats are accounted to the bucket the last one arrived in */
+	if (!rc)
+		rc = event_counter_add(ev->type, ev->serial, ev->last_seen, ev->count);
+
+	return rc;
+}
+
+void
+event_coalesce_flush(int all)
+{
+	struct event_coalesce *ev, *tmp;
+	time_t now = time(NULL);
+	int txn = 0;
+
+	list_for_each_entry_safe(ev, tmp, &event_coalesce_list, list) {
+		if (!all && ev->first_seen + config.event_window > now)
+			break;
+
+		if (ev->count) {
+			if (!txn)
+				txn = !db_exec_on(db_event, "BEGIN TRANSACTION;");
+			event_coalesce_update(ev);
+		}
+		event_coalesce_free(ev);
+	}
+
+	if (txn)
+		db_exec_on(db_event, "COMMIT;");
+
+	if (list_empty(&event_coalesce_list)) {
+		uloop_timeout_cancel(&event_coalesce_timeout);
+		return;
+	}
+
+	ev = list_first_entry(&event_coalesce_list, struct event_coalesce, list);
+	uloop_timeout_set(&event_coalesce_timeout,
+			  (ev->first_seen + config.event_window - now) * 1000);
+}
+
+static void
+event_coalesce_timeout_cb(struct uloop_timeout *t)
+{
+	event_coalesce_flush(0);
+}
+
+static void
+event_coalesce_drop(char *serial, int64_t timestamp)
+{
+	struct event_coalesce *ev, *tmp;
+
+	/* the rows these entries point at are about to be deleted */
+	list_for_each_entry_safe(ev, tmp, &event_coalesce_list, list)
+		if (serial ? !event_strcmp(ev->serial, serial) : ev->first_seen < timestamp)
+			event_coalesce_free(ev);
+}
+
+static int
+event_insert(char *type, char *serial, char *client, struct blob_attr *event, time_t now)
+{
+	sqlite3_stmt *stmt;
+	char sql[192];
+	int rc;
+
+	snprintf(sql, sizeof(sql),
+		 "INSERT INTO %s.event (type, serial, client, event, timestamp, last_seen) VALUES(@type, @serial, @client, @event, @timestamp, @timestamp)",
+		 DB_INGEST);
+
+	db_prepare_on(db_event, rc, stmt, sql);
 
 	db_bind_text(stmt, "@type", type);
 	db_bind_text(stmt, "@serial", serial);
 	db_bind_text(stmt, "@client", client);
-	db_bind_text(stmt, "@event", event);
-	db_bind_int64(stmt, "@timestamp", time(NULL));
+	if (blobmsg_type(event) == BLOBMSG_TYPE_TABLE) {
+		db_bind_blob(stmt, "@event", event);
+	} else {
+		db_bind_text(stmt, "@event", blobmsg_get_string(event));
+	}
+	db_bind_int64(stmt, "@timestamp", now);
 
 	return db_insert(stmt);
 }
 
 static int
+event_fts_add(sqlite3_int64 rowid, char *event)
+{
+	char *sql = "INSERT INTO event_fts (rowid, event) VALUES(@rowid, @event)";
+	sqlite3_stmt *stmt;
+	int rc;
+
+	db_prepare_on(db_event, rc, stmt, sql);
+
+	db_bind_int64(stmt, "@rowid", rowid);
+	db_bind_text(stmt, "@event", event);
+
+	return db_insert(stmt);
+}
+
+int
+event_add(char *type, char *serial, char *client, struct blob_attr *event)
+{
+	/* table payloads are stored as they are, only text ones get coalesced and indexed */
+	char *text = blobmsg_type(event) == BLOBMSG_TYPE_STRING ? blobmsg_get_string(event) : NULL;
+	time_t now = time(NULL);
+	struct event_coalesce *ev;
+	sqlite3_int64 rowid;
+	int rc;
+
+	/* event_list merges pending repeats, so even those change what it returns */
+	cache_bump(CACHE_TABLE_EVENT, serial);
+
+	if (config.event_window && text) {
+		ev = event_coalesce_find(type, serial, client, text);
+		if (ev) {
+			ev->last_seen = now;
+			ev->count++;
+			return 0;
+		}
+	}
+
+	rc = db_exec_on(db_event, "BEGIN TRANSACTION;");
+	if (rc)
+		return rc;
+
+	rc = event_insert(type, serial, client, event, now);
+	rowid = sqlite3_last_insert_rowid(db_event);
+	if (!rc)
+		rc = event_counter_add(type, serial, now, 1);
+	/* with tiering the index is fed when rows reach main */
+	if (!rc && text && config.fts && !config.hot_path)
+		rc = event_fts_add(rowid, text);
+
+	if (rc) {
+		db_exec_on(db_event, "ROLLBACK;");
+		return rc;
+	}
+
+	rc = db_exec_on(db_event, "COMMIT;");
+	if (!rc && text && config.event_window)
+		event_coalesce_track(type, serial, client, text, rowid, now);
+
+	return rc;
+}
+
+int
 event_list_cb(struct blob_buf *b, sqlite3_stmt *stmt)
 {
 	void *c = blobmsg_open_array(b, NULL);
+	struct event_coalesce *ev = NULL;
+	sqlite3_int64 last_seen = sqlite3_column_int64(stmt, 5);
+	sqlite3_int64 count = sqlite3_column_int64(stmt, 6);
 	int i;
 
-	blobmsg_add_u64(b, NULL, sqlite3_column_int(stmt, 0));
+	/*
+	 * merge repeats that are still pending in memory, only text events get
+	 * coalesced. The type has to be checked before sqlite3_column_text()
+	 * converts a table payload into a string.
+	 */
+	if (sqlite3_column_type(stmt, 2) == SQLITE_TEXT)
+		ev = event_coalesce_find(sqlite3_column_text(stmt, 1), sqlite3_column_text(stmt, 3),
+					 sqlite3_column_text(stmt, 4), sqlite3_column_text(stmt, 2));
+	if (ev && ev->rowid == sqlite3_column_int64(stmt, 7) &&
+	    sqlite3_column_int(stmt, 8) == !!config.hot_path) {
+		last_seen = ev->last_seen;
+		count += ev->count;
+	}
+
+	blobmsg_add_u64(b, NULL, sqlite3_column_int64(stmt, 0));
 	for (i = 1; i < 5; i++) {
-		const char *val = sqlite3_column_text(stmt, i);
+		const char *val;
+
+		if (sqlite3_column_type(stmt, i) == SQLITE_BLOB) {
+			blobmsg_add_field(b, BLOBMSG_TYPE_TABLE, NULL,
+					  sqlite3_column_blob(stmt, i),
+					  sqlite3_column_bytes(stmt, i));
+			continue;
+		}
 
+		val = sqlite3_column_text(stmt, i);
 		if (val)
 			blobmsg_add_string(b, NULL, val);
 		else
 			blobmsg_add_u8(b, NULL, 0);
 	}
+	blobmsg_add_u64(b, NULL, last_seen);
+	blobmsg_add_u64(b, NULL, count);
 	blobmsg_close_array(b, c);
 
 	return 0;
@@ -59,7 +403,7 @@ event_list_cb(struct blob_buf *b, sqlite3_stmt *stmt)
 int
 event_list(struct blob_buf *b, char *type, char *serial, char *client, int rows)
 {
-	char *sql_all = "SELECT timestamp, type, event, serial, client FROM event %s%s%sORDER by timestamp DESC LIMIT @rows;";
+	char *sql_all = "SELECT timestamp, type, event, serial, client, COALESCE(last_seen, timestamp), count, id, tier FROM event_all ORDER by timestamp DESC LIMIT @rows;";
 	char *sql = sql_all;
 	sqlite3_stmt *stmt;
 	char sql_buf[256];
@@ -82,11 +426,11 @@ event_list(struct blob_buf *b, char *type, char *serial, char *client, int rows)
 
 		/* @key = @val will always bind as WHERE 'key' = 'value' breaking the where conditional when using the bind API */
 		snprintf(sql_buf, sizeof(sql_buf),
-			       "SELECT timestamp, type, event, serial, client FROM event WHERE %s = '%s' ORDER by timestamp DESC LIMIT @rows;",
+			       "SELECT timestamp, type, event, serial, client, COALESCE(last_seen, timestamp), count, id, tier FROM event_all WHERE %s = '%s' ORDER by timestamp DESC LIMIT @rows;",
 			       key, val);
 	}
 
-	db_prepare(rc, stmt, sql);
+	db_prepare_on(db_event, rc, stmt, sql);
 
 	db_bind_int64(stmt, "@rows", rows);
 
@@ -94,29 +438,155 @@ event_list(struct blob_buf *b, char *type, char *serial, char *client, int rows)
 }
 
 int
-event_remove_serial(char *serial)
+event_search(struct blob_buf *b, char *query, char *type, char *serial,
+	     int64_t from, int64_t to, int rows, int offset)
 {
-	char *sql = "DELETE FROM event WHERE serial = @serial";
-	sqlite3_stmt *stmt = NULL;
+	char *sql = "SELECT e.timestamp, e.type, e.event, e.serial, e.client, COALESCE(e.last_seen, e.timestamp), e.count, e.rowid, 0 "
+		    "FROM event_fts JOIN main.event e ON e.rowid = event_fts.rowid "
+		    "WHERE event_fts MATCH @query AND (@type IS NULL OR e.type = @type) AND (@serial IS NULL OR e.serial = @serial) "
+		    "AND e.timestamp >= @from AND e.timestamp <= @to "
+		    "ORDER BY event_fts.rank LIMIT @rows OFFSET @offset;";
+	sqlite3_stmt *stmt;
 	int rc;
 
-	db_prepare(rc, stmt, sql);
+	if (!config.fts)
+		return -1;
+
+	db_prepare_on(db_event, rc, stmt, sql);
 
+	db_bind_text(stmt, "@query", query);
+	db_bind_text(stmt, "@type", type);
 	db_bind_text(stmt, "@serial", serial);
+	db_bind_int64(stmt, "@from", from);
+	db_bind_int64(stmt, "@to", to);
+	db_bind_int64(stmt, "@rows", rows);
+	db_bind_int64(stmt, "@offset", offset);
 
-	return db_delete(stmt);
+	return db_select(stmt, b, event_list_cb);
+}
+
+static int
+event_count_cb(struct blob_buf *b, sqlite3_stmt *stmt)
+{
+	void *c = blobmsg_open_array(b, NULL);
+
+	blobmsg_add_string(b, NULL, sqlite3_column_text(stmt, 0));
+	blobmsg_add_string(b, NULL, sqlite3_column_text(stmt, 1));
+	blobmsg_add_u64(b, NULL, sqlite3_column_int64(stmt, 2));
+	blobmsg_close_array(b, c);
+
+	return 0;
+}
+
+static int
+event_histogram_cb(struct blob_buf *b, sqlite3_stmt *stmt)
+{
+	void *c = blobmsg_open_array(b, NULL);
+
+	blobmsg_add_u64(b, NULL, sqlite3_column_int64(stmt, 0));
+	blobmsg_add_u64(b, NULL, sqlite3_column_int64(stmt, 1));
+	blobmsg_close_array(b, c);
+
+	return 0;
 }
 
 int
-event_purge(int timestamp)
+event_count(struct blob_buf *b, char *type, char *serial,
+	    int64_t from, int64_t to, int histogram)
+{
+	char *counter_main = "main.event_counter";
+	char *counter_all = "(SELECT type, serial, bucket, count FROM main.event_counter UNION ALL "
+			    "SELECT type, serial, bucket, count FROM hot.event_counter)";
+	char *sql_count = "SELECT type, serial, SUM(count) FROM %s "
+			  "WHERE (@type IS NULL OR type = @type) AND (@serial IS NULL OR serial = @serial) "
+			  "AND bucket >= @from AND bucket <= @to GROUP BY type, serial ORDER BY 3 DESC;";
+	char *sql_histogram = "SELECT bucket, SUM(count) FROM %s "
+			      "WHERE (@type IS NULL OR type = @type) AND (@serial IS NULL OR serial = @serial) "
+			      "AND bucket >= @from AND bucket <= @to GROUP BY bucket ORDER BY bucket;";
+	sqlite3_stmt *stmt;
+	char sql[512];
+	int rc;
+
+	snprintf(sql, sizeof(sql), histogram ? sql_histogram : sql_count,
+		 config.hot_path ? counter_all : counter_main);
+
+	db_prepare_on(db_event, rc, stmt, sql);
+
+	/* the bucket that from falls into is counted as a whole */
+	db_bind_text(stmt, "@type", type);
+	db_bind_text(stmt, "@serial", serial);
+	db_bind_int64(stmt, "@from", from - from % EVENT_COUNT_BUCKET);
+	db_bind_int64(stmt, "@to", to);
+
+	return db_select(stmt, b, histogram ? event_histogram_cb : event_count_cb);
+}
+
+static int
+event_delete_stmt(char *sql, char *serial, int64_t timestamp)
 {
-	char *sql = "DELETE FROM event WHERE timestamp < @timestamp";
 	sqlite3_stmt *stmt = NULL;
 	int rc;
 
-	db_prepare(rc, stmt, sql);
+	db_prepare_on(db_event, rc, stmt, sql);
 
-	db_bind_int64(stmt, "@timestamp", timestamp);
+	if (serial) {
+		db_bind_text(stmt, "@serial", serial);
+	} else {
+		db_bind_int64(stmt, "@timestamp", timestamp);
+	}
 
 	return db_delete(stmt);
 }
+
+static int
+event_delete(char *fts_sql, char *sql, char *counter_sql, char *serial, int64_t timestamp)
+{
+	int rc;
+
+	rc = db_exec_on(db_event, "BEGIN TRANSACTION;");
+	if (rc)
+		return rc;
+
+	/* the external content index needs the old values to drop its entries */
+	if (config.fts)
+		rc = event_delete_stmt(fts_sql, serial, timestamp);
+
+	if (!rc)
+		rc = db_tier_delete(db_event, sql, serial, timestamp);
+	if (!rc)
+		rc = db_tier_delete(db_event, counter_sql, serial, timestamp);
+
+	if (rc) {
+		db_exec_on(db_event, "ROLLBACK;");
+		return rc;
+	}
+
+	return db_exec_on(db_event, "COMMIT;");
+}
+
+int
+event_remove_serial(char *serial)
+{
+	char *fts_sql = "INSERT INTO event_fts (event_fts, rowid, event) SELECT 'delete', rowid, event FROM main.event WHERE serial = @serial AND typeof(event) = 'text'";
+	char *sql = "DELETE FROM %s.event WHERE serial = @serial";
+	char *counter_sql = "DELETE FROM %s.event_counter WHERE serial = @serial";
+
+	cache_bump(CACHE_TABLE_EVENT, serial);
+	event_coalesce_drop(serial, 0);
+
+	return event_delete(fts_sql, sql, counter_sql, serial, 0);
+}
+
+int
+event_purge(int64_t timestamp)
+{
+	char *fts_sql = "INSERT INTO event_fts (event_fts, rowid, event) SELECT 'delete', rowid, event FROM main.event WHERE timestamp < @timestamp AND typeof(event) = 'text'";
+	char *sql = "DELETE FROM %s.event WHERE timestamp < @timestamp";
+	/* buckets still holding rows that are kept stay around */
+	char *counter_sql = "DELETE FROM %s.event_counter WHERE bucket + " db_str(EVENT_COUNT_BUCKET) " <= @timestamp";
+
+	cache_bump(CACHE_TABLE_EVENT, NULL);
+	event_coalesce_drop(NULL, timestamp);
+
+	return event_delete(fts_sql, sql, counter_sql, NULL, timestamp);
+}
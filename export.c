@@ -0,0 +1,363 @@
+/*
+ * Copyright (C) 2022 John Crispin <john@phrozen.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include <libubox/blobmsg_json.h>
+#include <libubox/uloop.h>
+
+#include "db.h"
+
+/*
+ * Rows are streamed from the cursor into the file one record at a time.
+ * Each record is a blobmsg table with a "table" member naming its origin,
+ * written either as a raw blob_attr (which carries its own length header)
+ * or as one line of JSON.
+ *
+ * The export runs in steps of EXPORT_STEP_ROWS rows off a timer, like the
+ * backup does, so ingest keeps going while a large history is written.
+ * Rows written while an export is running may or may not end up in it.
+ */
+
+/* rows written per step and ms between two steps */
+#define EXPORT_STEP_ROWS	256
+#define EXPORT_INTERVAL		10
+
+enum {
+	EXPORT_DEVICE,
+	EXPORT_STATE,
+	EXPORT_HEALTH,
+	EXPORT_EVENT,
+	__EXPORT_MAX,
+};
+
+static void export_step_cb(struct uloop_timeout *t);
+
+static struct {
+	struct uloop_timeout timeout;
+	sqlite3_stmt *stmt;
+	int phase;
+
+	int fd;
+	int json;
+	int error;
+	struct blob_buf rec;
+
+	char path[PATH_MAX];
+	char *serial;
+	int64_t from;
+	int64_t to;
+
+	uint64_t rows;
+	uint64_t bytes;
+
+	size_t len;
+	char buf[64 * 1024];
+} export = {
+	.timeout.cb = export_step_cb,
+	.fd = -1,
+};
+
+static void
+export_write_fd(const char *data, size_t len)
+{
+	while (len && !export.error) {
+		ssize_t n = write(export.fd, data, len);
+
+		if (n < 0) {
+			if (errno != EINTR)
+				export.error = errno;
+			continue;
+		}
+		data += n;
+		len -= n;
+	}
+}
+
+static void
+export_flush(void)
+{
+	export_write_fd(export.buf, export.len);
+	export.len = 0;
+}
+
+static void
+export_write(const void *data, size_t len)
+{
+	export.bytes += len;
+
+	if (len > sizeof(export.buf) - export.len)
+		export_flush();
+
+	/* records larger than the buffer bypass it */
+	if (len > sizeof(export.buf)) {
+		export_write_fd(data, len);
+		return;
+	}
+
+	memcpy(&export.buf[export.len], data, len);
+	export.len += len;
+}
+
+static void
+export_record(void)
+{
+	export.rows++;
+
+	if (export.json) {
+		char *str = blobmsg_format_json(export.rec.head, true);
+
+		if (!str) {
+			export.error = ENOMEM;
+			return;
+		}
+		export_write(str, strlen(str));
+		export_write("\n", 1);
+		free(str);
+	} else {
+		export_write(export.rec.head, blob_pad_len(export.rec.head));
+	}
+}
+
+static void
+export_add_text(struct blob_buf *b, const char *name, sqlite3_stmt *stmt, int col)
+{
+	const char *val = (const char *) sqlite3_column_text(stmt, col);
+
+	if (val)
+		blobmsg_add_string(b, name, val);
+}
+
+static void
+export_device(sqlite3_stmt *stmt)
+{
+	blobmsg_add_string(&export.rec, "table", "device");
+	export_add_text(&export.rec, "serial", stmt, 0);
+	export_add_text(&export.rec, "compatible", stmt, 1);
+	blobmsg_add_u64(&export.rec, "created", sqlite3_column_int64(stmt, 2));
+	blobmsg_add_u64(&export.rec, "modified", sqlite3_column_int64(stmt, 3));
+}
+
+static void
+export_blob(sqlite3_stmt *stmt, const char *table)
+{
+	blobmsg_add_string(&export.rec, "table", table);
+	blobmsg_add_string(&export.rec, "serial", export.serial);
+	blobmsg_add_u64(&export.rec, "timestamp", sqlite3_column_int64(stmt, 0));
+	blobmsg_add_field(&export.rec, BLOBMSG_TYPE_TABLE, "data",
+			  sqlite3_column_blob(stmt, 1),
+			  sqlite3_column_bytes(stmt, 1));
+}
+
+static void
+export_event(sqlite3_stmt *stmt)
+{
+	blobmsg_add_string(&export.rec, "table", "event");
+	blobmsg_add_string(&export.rec, "serial", export.serial);
+	blobmsg_add_u64(&export.rec, "timestamp", sqlite3_column_int64(stmt, 0));
+	export_add_text(&export.rec, "type", stmt, 1);
+	export_add_text(&export.rec, "client", stmt, 2);
+	if (sqlite3_column_type(stmt, 3) == SQLITE_BLOB)
+		blobmsg_add_field(&export.rec, BLOBMSG_TYPE_TABLE, "event",
+				  sqlite3_column_blob(stmt, 3),
+				  sqlite3_column_bytes(stmt, 3));
+	else
+		export_add_text(&export.rec, "event", stmt, 3);
+	blobmsg_add_u64(&export.rec, "last_seen", sqlite3_column_int64(stmt, 4));
+	blobmsg_add_u64(&export.rec, "count", sqlite3_column_int64(stmt, 5));
+}
+
+static const struct {
+	int idx;
+	char *sql;
+} export_phases[__EXPORT_MAX] = {
+	[EXPORT_DEVICE] = { DB_MAIN, "SELECT serial, compatible, created, modified FROM device WHERE serial = @serial" },
+	[EXPORT_STATE] = { DB_STATE, "SELECT timestamp, state FROM state_all WHERE serial = @serial AND timestamp >= @from AND timestamp <= @to ORDER BY timestamp" },
+	[EXPORT_HEALTH] = { DB_HEALTH, "SELECT timestamp, health FROM health_all WHERE serial = @serial AND timestamp >= @from AND timestamp <= @to ORDER BY timestamp" },
+	[EXPORT_EVENT] = { DB_EVENT, "SELECT timestamp, type, client, event, COALESCE(last_seen, timestamp), count FROM event_all WHERE serial = @serial AND timestamp >= @from AND timestamp <= @to ORDER BY timestamp" },
+};
+
+/* the cursor stays open across steps, so the binds are done without the finalizing db_bind_* macros */
+static int
+export_open(int phase)
+{
+	sqlite3 *h = db_handle[export_phases[phase].idx];
+	sqlite3_stmt *stmt;
+	int rc, idx;
+
+	rc = sqlite3_prepare_v2(h, export_phases[phase].sql, -1, &stmt, 0);
+	if (rc == SQLITE_OK)
+		rc = sqlite3_bind_text(stmt, sqlite3_bind_parameter_index(stmt, "@serial"),
+				       export.serial, -1, SQLITE_STATIC);
+	if (rc == SQLITE_OK && (idx = sqlite3_bind_parameter_index(stmt, "@from")))
+		rc = sqlite3_bind_int64(stmt, idx, export.from);
+	if (rc == SQLITE_OK && (idx = sqlite3_bind_parameter_index(stmt, "@to")))
+		rc = sqlite3_bind_int64(stmt, idx, export.to);
+
+	if (rc != SQLITE_OK) {
+		ulog(LOG_ERR, "SQL error (%s:%d): (%d) - %s\n", __func__, __LINE__, rc, sqlite3_errmsg(h));
+		sqlite3_finalize(stmt);
+		return -1;
+	}
+
+	export.phase = phase;
+	export.stmt = stmt;
+
+	return 0;
+}
+
+static void
+export_finish(void)
+{
+	uloop_timeout_cancel(&export.timeout);
+
+	sqlite3_finalize(export.stmt);
+	export.stmt = NULL;
+
+	export_flush();
+	if (close(export.fd) && !export.error)
+		export.error = errno;
+	export.fd = -1;
+
+	if (export.error)
+		ulog(LOG_ERR, "Cannot write %s: %s\n", export.path, strerror(export.error));
+	else
+		ulog(LOG_INFO, "export to %s completed, %llu rows\n", export.path,
+		     (unsigned long long) export.rows);
+
+	free(export.serial);
+	export.serial = NULL;
+	blob_buf_free(&export.rec);
+}
+
+static void
+export_step_cb(struct uloop_timeout *t)
+{
+	int i, rc;
+
+	for (i = 0; i < EXPORT_STEP_ROWS && !export.error; i++) {
+		rc = sqlite3_step(export.stmt);
+
+		if (rc == SQLITE_DONE) {
+			sqlite3_finalize(export.stmt);
+			export.stmt = NULL;
+
+			if (export.phase + 1 == __EXPORT_MAX)
+				break;
+			if (export_open(export.phase + 1))
+				export.error = EIO;
+			continue;
+		}
+
+		if (rc != SQLITE_ROW) {
+			ulog(LOG_ERR, "SQL error (%s:%d): (%d) - %s\n", __func__, __LINE__, rc,
+			     sqlite3_errmsg(sqlite3_db_handle(export.stmt)));
+			export.error = EIO;
+			break;
+		}
+
+		blob_buf_init(&export.rec, 0);
+		switch (export.phase) {
+		case EXPORT_DEVICE:
+			export_device(export.stmt);
+			break;
+		case EXPORT_STATE:
+			export_blob(export.stmt, "state");
+			break;
+		case EXPORT_HEALTH:
+			export_blob(export.stmt, "health");
+			break;
+		case EXPORT_EVENT:
+			export_event(export.stmt);
+			break;
+		}
+		export_record();
+	}
+
+	if (export.stmt && !export.error)
+		uloop_timeout_set(t, EXPORT_INTERVAL);
+	else
+		export_finish();
+}
+
+int
+export_serial(char *path, int json, char *serial, int64_t from, int64_t to)
+{
+	if (export.fd >= 0)
+		return -1;
+
+	snprintf(export.path, sizeof(export.path), "%s", path);
+	export.serial = strdup(serial);
+	if (!export.serial)
+		return -1;
+
+	export.json = json;
+	export.from = from;
+	export.to = to;
+	export.rows = 0;
+	export.bytes = 0;
+	export.error = 0;
+	export.len = 0;
+
+	export.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (export.fd < 0) {
+		ulog(LOG_ERR, "Cannot open %s: %s\n", path, strerror(errno));
+		export.error = errno;
+		free(export.serial);
+		export.serial = NULL;
+		return -1;
+	}
+
+	/* pending repeats would otherwise be missing from the export */
+	event_coalesce_flush(1);
+
+	if (export_open(EXPORT_DEVICE)) {
+		export.error = EIO;
+		export_finish();
+		return -1;
+	}
+
+	uloop_timeout_set(&export.timeout, 0);
+
+	return 0;
+}
+
+void
+export_stop(void)
+{
+	if (export.fd < 0)
+		return;
+
+	export.error = ECANCELED;
+	export_finish();
+}
+
+void
+export_status(struct blob_buf *b)
+{
+	blobmsg_add_u8(b, "running", export.fd >= 0);
+	if (!export.path[0])
+		return;
+
+	blobmsg_add_string(b, "path", export.path);
+	blobmsg_add_u64(b, "rows", export.rows);
+	blobmsg_add_u64(b, "bytes", export.bytes);
+	if (export.fd < 0)
+		blobmsg_add_string(b, "result", export.error ? strerror(export.error) : "ok");
+}
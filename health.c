@@ -21,11 +21,21 @@
 int
 health_add(char *serial, struct blob_attr *b)
 {
-	char *sql = "INSERT INTO health (serial, health, timestamp) VALUES(@serial, @health, @timestamp)";
 	sqlite3_stmt *stmt;
+	char sql[128];
 	int rc;
 
-	db_prepare(rc, stmt, sql);
+	cache_bump(CACHE_TABLE_HEALTH, serial);
+
+	/* main deduplicates payloads, the hot tier keeps them inline */
+	if (!config.hot_path)
+		return blobstore_insert(db_health, "health", serial, b);
+
+	snprintf(sql, sizeof(sql),
+		 "INSERT INTO %s.health (serial, health, timestamp) VALUES(@serial, @health, @timestamp)",
+		 DB_INGEST);
+
+	db_prepare_on(db_health, rc, stmt, sql);
 
 	db_bind_text(stmt, "@serial", serial);
 	db_bind_blob(stmt, "@health", b);
@@ -34,12 +44,12 @@ health_add(char *serial, struct blob_attr *b)
 	return db_insert(stmt);
 }
 
-static int
+int
 health_list_cb(struct blob_buf *b, sqlite3_stmt *stmt)
 {
 	void *c = blobmsg_open_array(b, NULL);
 
-	blobmsg_add_u64(b, NULL, sqlite3_column_int(stmt, 0));
+	blobmsg_add_u64(b, NULL, sqlite3_column_int64(stmt, 0));
 	blobmsg_add_field(b, BLOBMSG_TYPE_TABLE, NULL,
 			  sqlite3_column_blob(stmt, 1),
 			  sqlite3_column_bytes(stmt, 1));
@@ -51,11 +61,11 @@ health_list_cb(struct blob_buf *b, sqlite3_stmt *stmt)
 int
 health_list(struct blob_buf *b, char *serial, int rows)
 {
-	char *sql = "SELECT timestamp, health FROM health WHERE serial = @serial ORDER by timestamp DESC LIMIT @rows;";
+	char *sql = "SELECT timestamp, health FROM health_all WHERE serial = @serial ORDER by timestamp DESC LIMIT @rows;";
 	sqlite3_stmt *stmt;
 	int rc;
 
-	db_prepare(rc, stmt, sql);
+	db_prepare_on(db_health, rc, stmt, sql);
 
 	db_bind_text(stmt, "@serial", serial);
 	db_bind_int64(stmt, "@rows", rows);
@@ -66,26 +76,18 @@ health_list(struct blob_buf *b, char *serial, int rows)
 int
 health_remove_serial(char *serial)
 {
-	char *sql = "DELETE FROM health WHERE serial = @serial";
-	sqlite3_stmt *stmt = NULL;
-	int rc;
+	char *sql = "DELETE FROM %s.health WHERE serial = @serial";
 
-	db_prepare(rc, stmt, sql);
+	cache_bump(CACHE_TABLE_HEALTH, serial);
 
-	db_bind_text(stmt, "@serial", serial);
-
-	return db_delete(stmt);
+	return db_tier_delete(db_health, sql, serial, 0);
 }
 
-int health_purge(int timestamp)
+int health_purge(int64_t timestamp)
 {
-	char *sql = "DELETE FROM health WHERE timestamp < @timestamp";
-	sqlite3_stmt *stmt = NULL;
-	int rc;
-
-	db_prepare(rc, stmt, sql);
+	char *sql = "DELETE FROM %s.health WHERE timestamp < @timestamp";
 
-	db_bind_int64(stmt, "@timestamp", timestamp);
+	cache_bump(CACHE_TABLE_HEALTH, NULL);
 
-	return db_delete(stmt);
+	return db_tier_delete(db_health, sql, NULL, timestamp);
 }
@@ -0,0 +1,511 @@
+/*
+ * Copyright (C) 2022 John Crispin <john@phrozen.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <unistd.h>
+
+#include <libubox/blobmsg_json.h>
+
+#include "db.h"
+
+/*
+ * Offline loader for files written by the export method. Rows are staged
+ * in temporary tables first and copied over sorted by (serial, timestamp)
+ * with the indexes dropped, journaling disabled and a large page cache.
+ */
+
+#define IMPORT_CACHE_KB		(64 * 1024)
+
+/* only the schema and blob store are linked in, the daemon's globals live here */
+struct config config;
+struct blob_buf b;
+sqlite3 *db;
+sqlite3 *db_handle[__DB_MAX];
+
+enum {
+	IMPORT_TABLE,
+	IMPORT_SERIAL,
+	IMPORT_COMPAT,
+	IMPORT_CREATED,
+	IMPORT_MODIFIED,
+	IMPORT_TIMESTAMP,
+	IMPORT_DATA,
+	IMPORT_TYPE,
+	IMPORT_CLIENT,
+	IMPORT_EVENT,
+	IMPORT_LAST_SEEN,
+	IMPORT_COUNT,
+	__IMPORT_MAX,
+};
+
+/* numbers are left untyped, JSON input yields INT32 for small values */
+static const struct blobmsg_policy import_policy[__IMPORT_MAX] = {
+	[IMPORT_TABLE]		= { "table", BLOBMSG_TYPE_STRING },
+	[IMPORT_SERIAL]		= { "serial", BLOBMSG_TYPE_STRING },
+	[IMPORT_COMPAT]		= { "compatible", BLOBMSG_TYPE_STRING },
+	[IMPORT_CREATED]	= { "created", BLOBMSG_TYPE_UNSPEC },
+	[IMPORT_MODIFIED]	= { "modified", BLOBMSG_TYPE_UNSPEC },
+	[IMPORT_TIMESTAMP]	= { "timestamp", BLOBMSG_TYPE_UNSPEC },
+	[IMPORT_DATA]		= { "data", BLOBMSG_TYPE_TABLE },
+	[IMPORT_TYPE]		= { "type", BLOBMSG_TYPE_STRING },
+	[IMPORT_CLIENT]		= { "client", BLOBMSG_TYPE_STRING },
+	[IMPORT_EVENT]		= { "event", BLOBMSG_TYPE_UNSPEC },
+	[IMPORT_LAST_SEEN]	= { "last_seen", BLOBMSG_TYPE_UNSPEC },
+	[IMPORT_COUNT]		= { "count", BLOBMSG_TYPE_UNSPEC },
+};
+
+static char *import_staging[] = {
+	"CREATE TEMP TABLE import_state (serial TEXT, timestamp BIGINT, data BLOB);",
+	"CREATE TEMP TABLE import_health (serial TEXT, timestamp BIGINT, data BLOB);",
+	"CREATE TEMP TABLE import_event (type TEXT, serial TEXT, client TEXT, event TEXT, timestamp BIGINT, last_seen BIGINT, count INTEGER);",
+	NULL
+};
+
+static char *import_copy[] = {
+	"INSERT OR IGNORE INTO blob_store (hash, data, refs) SELECT blob_hash(data), data, 0 FROM import_state;",
+	"INSERT INTO state (serial, state, timestamp, hash, seq) "
+		"SELECT i.serial, CASE WHEN b.data = i.data THEN X'' ELSE i.data END, i.timestamp, CASE WHEN b.data = i.data THEN b.hash END, "
+		"(SELECT IFNULL(MAX(s.seq), 0) FROM state s WHERE s.serial = i.serial AND s.timestamp = i.timestamp) + i.rowid "
+		"FROM import_state i LEFT JOIN blob_store b ON b.hash = blob_hash(i.data) ORDER BY i.serial, i.timestamp;",
+	"INSERT OR IGNORE INTO blob_store (hash, data, refs) SELECT blob_hash(data), data, 0 FROM import_health;",
+	"INSERT INTO health (serial, health, timestamp, hash, seq) "
+		"SELECT i.serial, CASE WHEN b.data = i.data THEN X'' ELSE i.data END, i.timestamp, CASE WHEN b.data = i.data THEN b.hash END, "
+		"(SELECT IFNULL(MAX(h.seq), 0) FROM health h WHERE h.serial = i.serial AND h.timestamp = i.timestamp) + i.rowid "
+		"FROM import_health i LEFT JOIN blob_store b ON b.hash = blob_hash(i.data) ORDER BY i.serial, i.timestamp;",
+	"INSERT INTO event (type, serial, client, event, timestamp, last_seen, count) SELECT type, serial, client, event, timestamp, last_seen, count FROM import_event ORDER BY serial, timestamp;",
+	"INSERT INTO event_counter (type, serial, bucket, count) "
+		"SELECT type, IFNULL(serial, ''), timestamp - timestamp % " db_str(EVENT_COUNT_BUCKET) ", SUM(count) "
+		"FROM import_event WHERE true GROUP BY 1, 2, 3 "
+		"ON CONFLICT(type, serial, bucket) DO UPDATE SET count = count + excluded.count;",
+	"DROP TABLE import_state;",
+	"DROP TABLE import_health;",
+	"DROP TABLE import_event;",
+	NULL
+};
+
+static struct {
+	sqlite3_stmt *device;
+	sqlite3_stmt *state;
+	sqlite3_stmt *health;
+	sqlite3_stmt *event;
+
+	char **indexes;
+	int n_indexes;
+
+	uint64_t rows;
+	uint64_t skipped;
+} import;
+
+static int64_t
+import_int(struct blob_attr *attr, int64_t def)
+{
+	if (!attr)
+		return def;
+
+	switch (blobmsg_type(attr)) {
+	case BLOBMSG_TYPE_INT64:
+		return blobmsg_get_u64(attr);
+	case BLOBMSG_TYPE_INT32:
+		return (int32_t) blobmsg_get_u32(attr);
+	case BLOBMSG_TYPE_INT16:
+		return (int16_t) blobmsg_get_u16(attr);
+	case BLOBMSG_TYPE_INT8:
+		return blobmsg_get_u8(attr);
+	}
+
+	return def;
+}
+
+static char *
+import_string(struct blob_attr *attr)
+{
+	return attr ? blobmsg_get_string(attr) : NULL;
+}
+
+static int
+import_step(sqlite3_stmt *stmt)
+{
+	int rc = sqlite3_step(stmt);
+
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+
+	if (rc != SQLITE_DONE) {
+		ulog(LOG_ERR, "SQL error: (%d) - %s\n", rc, sqlite3_errmsg(db));
+		return -1;
+	}
+	import.rows++;
+
+	return 0;
+}
+
+/* a failed bind finalizes the cached statement, forget it so import_finish() does not do it again */
+#define import_bind(type, stmt, id, value)				\
+	if (__db_bind_##type(*stmt, id, value, __func__, __LINE__)) {	\
+		*stmt = NULL;						\
+		return -1;						\
+	}
+
+static int
+import_record(struct blob_attr *msg)
+{
+	struct blob_attr *tb[__IMPORT_MAX];
+	sqlite3_stmt **stmt;
+	char *table;
+
+	blobmsg_parse(import_policy, __IMPORT_MAX, tb, blob_data(msg), blob_len(msg));
+
+	if (!tb[IMPORT_TABLE] || !tb[IMPORT_SERIAL])
+		goto skip;
+
+	table = blobmsg_get_string(tb[IMPORT_TABLE]);
+
+	if (!strcmp(table, "device")) {
+		if (!tb[IMPORT_COMPAT])
+			goto skip;
+
+		stmt = &import.device;
+		import_bind(text, stmt, "@serial", blobmsg_get_string(tb[IMPORT_SERIAL]));
+		import_bind(text, stmt, "@compat", blobmsg_get_string(tb[IMPORT_COMPAT]));
+		import_bind(int64, stmt, "@created", import_int(tb[IMPORT_CREATED], 0));
+		import_bind(int64, stmt, "@modified", import_int(tb[IMPORT_MODIFIED], 0));
+
+		return import_step(*stmt);
+	}
+
+	if (!tb[IMPORT_TIMESTAMP])
+		goto skip;
+
+	if (!strcmp(table, "state") || !strcmp(table, "health")) {
+		if (!tb[IMPORT_DATA])
+			goto skip;
+
+		stmt = !strcmp(table, "state") ? &import.state : &import.health;
+		import_bind(text, stmt, "@serial", blobmsg_get_string(tb[IMPORT_SERIAL]));
+		import_bind(int64, stmt, "@timestamp", import_int(tb[IMPORT_TIMESTAMP], 0));
+		import_bind(blob, stmt, "@data", tb[IMPORT_DATA]);
+
+		return import_step(*stmt);
+	}
+
+	if (!strcmp(table, "event")) {
+		int64_t timestamp = import_int(tb[IMPORT_TIMESTAMP], 0);
+
+		if (!tb[IMPORT_TYPE])
+			goto skip;
+
+		stmt = &import.event;
+		import_bind(text, stmt, "@type", blobmsg_get_string(tb[IMPORT_TYPE]));
+		import_bind(text, stmt, "@serial", blobmsg_get_string(tb[IMPORT_SERIAL]));
+		import_bind(text, stmt, "@client", import_string(tb[IMPORT_CLIENT]));
+		if (tb[IMPORT_EVENT] && blobmsg_type(tb[IMPORT_EVENT]) == BLOBMSG_TYPE_TABLE) {
+			import_bind(blob, stmt, "@event", tb[IMPORT_EVENT]);
+		} else {
+			import_bind(text, stmt, "@event", import_string(tb[IMPORT_EVENT]));
+		}
+		import_bind(int64, stmt, "@timestamp", timestamp);
+		import_bind(int64, stmt, "@last_seen", import_int(tb[IMPORT_LAST_SEEN], timestamp));
+		import_bind(int64, stmt, "@count", import_int(tb[IMPORT_COUNT], 1));
+
+		return import_step(*stmt);
+	}
+
+skip:
+	import.skipped++;
+
+	return 0;
+}
+
+static int
+import_file_blob(FILE *fp)
+{
+	struct blob_attr *attr = NULL;
+	size_t size = 0;
+	int rc = 0;
+
+	while (!rc) {
+		struct blob_attr hdr;
+		size_t len;
+
+		if (fread(&hdr, sizeof(hdr), 1, fp) != 1)
+			break;
+
+		len = blob_pad_len(&hdr);
+		if (len < sizeof(hdr)) {
+			rc = -1;
+			break;
+		}
+
+		if (len > size) {
+			struct blob_attr *tmp = realloc(attr, len);
+
+			if (!tmp) {
+				rc = -1;
+				break;
+			}
+			attr = tmp;
+			size = len;
+		}
+
+		memcpy(attr, &hdr, sizeof(hdr));
+		if (len > sizeof(hdr) && fread(attr->data, len - sizeof(hdr), 1, fp) != 1) {
+			ulog(LOG_ERR, "truncated record\n");
+			rc = -1;
+			break;
+		}
+
+		rc = import_record(attr);
+	}
+	free(attr);
+
+	return rc;
+}
+
+static int
+import_file_json(FILE *fp)
+{
+	struct blob_buf rec = {};
+	char *line = NULL;
+	size_t size = 0;
+	int rc = 0;
+
+	while (!rc && getline(&line, &size, fp) > 0) {
+		blob_buf_init(&rec, 0);
+		if (!blobmsg_add_json_from_string(&rec, line)) {
+			import.skipped++;
+			continue;
+		}
+		rc = import_record(rec.head);
+	}
+	blob_buf_free(&rec);
+	free(line);
+
+	return rc;
+}
+
+static int
+import_file(char *path)
+{
+	FILE *fp = fopen(path, "r");
+	int c, rc;
+
+	if (!fp) {
+		ulog(LOG_ERR, "Cannot open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	/* export writes either NDJSON or raw blobs, a JSON record starts with '{' */
+	c = fgetc(fp);
+	ungetc(c, fp);
+
+	if (c == '{')
+		rc = import_file_json(fp);
+	else
+		rc = import_file_blob(fp);
+	fclose(fp);
+
+	return rc;
+}
+
+static int
+import_exec_all(char **cmd)
+{
+	for (; *cmd; cmd++)
+		if (db_exec(*cmd))
+			return -1;
+
+	return 0;
+}
+
+static int
+import_drop_indexes(void)
+{
+	char *sql = "SELECT name, sql FROM sqlite_master WHERE type = 'index' AND sql IS NOT NULL";
+	sqlite3_stmt *stmt;
+	int rc, i;
+
+	db_prepare(rc, stmt, sql);
+
+	/* remember how each index was created so it can be rebuilt later on */
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		char **tmp = realloc(import.indexes, (import.n_indexes + 2) * sizeof(char *));
+
+		if (!tmp)
+			break;
+		import.indexes = tmp;
+		import.indexes[import.n_indexes++] = strdup((char *) sqlite3_column_text(stmt, 0));
+		import.indexes[import.n_indexes++] = strdup((char *) sqlite3_column_text(stmt, 1));
+	}
+	sqlite3_finalize(stmt);
+
+	for (i = 0; i < import.n_indexes; i += 2) {
+		char drop[128];
+
+		snprintf(drop, sizeof(drop), "DROP INDEX \"%s\";", import.indexes[i]);
+		if (db_exec(drop))
+			return -1;
+	}
+
+	return 0;
+}
+
+static int
+import_create_indexes(void)
+{
+	int rc = 0, i;
+
+	for (i = 0; i < import.n_indexes; i += 2) {
+		if (!rc)
+			rc = db_exec(import.indexes[i + 1]);
+		free(import.indexes[i]);
+		free(import.indexes[i + 1]);
+	}
+	free(import.indexes);
+	import.indexes = NULL;
+	import.n_indexes = 0;
+
+	return rc;
+}
+
+static int
+import_begin(void)
+{
+	char pragma[64];
+	int rc;
+
+	snprintf(pragma, sizeof(pragma), "PRAGMA cache_size = -%d;", IMPORT_CACHE_KB);
+
+	if (db_exec("PRAGMA journal_mode = OFF;") ||
+	    db_exec("PRAGMA synchronous = OFF;") ||
+	    db_exec("PRAGMA locking_mode = EXCLUSIVE;") ||
+	    db_exec(pragma) ||
+	    db_exec("BEGIN TRANSACTION;") ||
+	    import_drop_indexes() ||
+	    import_exec_all(import_staging))
+		return -1;
+
+	db_prepare(rc, import.device, "INSERT OR IGNORE INTO device (serial, compatible, created, modified) VALUES(@serial, @compat, @created, @modified)");
+	db_prepare(rc, import.state, "INSERT INTO import_state (serial, timestamp, data) VALUES(@serial, @timestamp, @data)");
+	db_prepare(rc, import.health, "INSERT INTO import_health (serial, timestamp, data) VALUES(@serial, @timestamp, @data)");
+	db_prepare(rc, import.event, "INSERT INTO import_event (type, serial, client, event, timestamp, last_seen, count) VALUES(@type, @serial, @client, @event, @timestamp, @last_seen, @count)");
+
+	return 0;
+}
+
+static int
+import_finish(void)
+{
+	sqlite3_finalize(import.device);
+	sqlite3_finalize(import.state);
+	sqlite3_finalize(import.health);
+	sqlite3_finalize(import.event);
+
+	if (import_exec_all(import_copy) ||
+	    import_create_indexes() ||
+	    db_exec("COMMIT;"))
+		return -1;
+
+	/* back to what uCollect itself runs with */
+	if (db_exec("PRAGMA locking_mode = NORMAL;") ||
+	    db_exec("PRAGMA journal_mode = DELETE;") ||
+	    db_exec("PRAGMA synchronous = FULL;") ||
+	    db_exec("ANALYZE;"))
+		return -1;
+
+	return 0;
+}
+
+/* everything goes into one file, the daemon builds the fts index on its first start */
+static int
+import_open(void)
+{
+	int i, rc;
+
+	rc = sqlite3_open(config.db_path, &db);
+	if (rc != SQLITE_OK) {
+		ulog(LOG_ERR, "Cannot open database %s: %s\n", config.db_path, sqlite3_errmsg(db));
+		sqlite3_close(db);
+		return rc;
+	}
+
+	for (i = 0; i < __DB_MAX; i++)
+		db_handle[i] = db;
+
+	rc = blobstore_init(db);
+	if (!rc)
+		rc = db_schema(DB_MAIN);
+	if (rc)
+		sqlite3_close(db);
+
+	return rc;
+}
+
+static int
+usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s -d <database> <file> [<file> ...]\n", prog);
+
+	return EXIT_FAILURE;
+}
+
+int main(int argc, char **argv)
+{
+	int ch, rc = 0;
+
+	ulog_open(ULOG_STDIO, LOG_USER, "uCollect-import");
+
+	while ((ch = getopt(argc, argv, "d:")) != -1) {
+		switch (ch) {
+		case 'd':
+			config.db_path = optarg;
+			break;
+		default:
+			return usage(argv[0]);
+		}
+	}
+
+	if (!config.db_path || optind >= argc)
+		return usage(argv[0]);
+
+	if (!access(config.db_path, F_OK)) {
+		ulog(LOG_ERR, "%s already exists, refusing to import into it\n", config.db_path);
+		return EXIT_FAILURE;
+	}
+
+	if (import_open())
+		return EXIT_FAILURE;
+
+	rc = import_begin();
+
+	for (; optind < argc && !rc; optind++)
+		rc = import_file(argv[optind]);
+
+	if (!rc)
+		rc = import_finish();
+	sqlite3_close(db);
+	blob_buf_free(&b);
+
+	/* without a journal there is nothing to roll back to, start over instead */
+	if (rc) {
+		ulog(LOG_ERR, "import failed, removing %s\n", config.db_path);
+		unlink(config.db_path);
+	} else {
+		ulog(LOG_INFO, "imported %llu rows, skipped %llu records\n",
+		     (unsigned long long) import.rows, (unsigned long long) import.skipped);
+	}
+
+	return rc ? EXIT_FAILURE : EXIT_SUCCESS;
+}
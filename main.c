@@ -14,15 +14,67 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <stdlib.h>
+#include <unistd.h>
+
 #include <libubox/uloop.h>
 
 #include "db.h"
 
+static int
+usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [options]\n"
+		"Options:\n"
+		"\t-c <dir>\tUCI config dir\n"
+		"\t-s <section>\tonly load this global section\n"
+		"\t-d <database>\tdatabase path\n"
+		"\t-r <socket>\treplicate to the follower listening on this socket\n"
+		"\t-f <socket>\tfollow a primary, listening on this socket\n"
+		"\n", prog);
+
+	return EXIT_FAILURE;
+}
+
 int main(int argc, char **argv)
 {
+	char *confdir = NULL, *section = NULL;
+	char *db_path = NULL, *replicate = NULL, *follow = NULL;
+	int ch;
+
 	ulog_open(ULOG_SYSLOG | ULOG_STDIO, LOG_DAEMON, "uStore");
 
-	config_load();
+	/* a primary and its follower run off the same package, these tell them apart */
+	while ((ch = getopt(argc, argv, "c:s:d:r:f:")) != -1) {
+		switch (ch) {
+		case 'c':
+			confdir = optarg;
+			break;
+		case 's':
+			section = optarg;
+			break;
+		case 'd':
+			db_path = optarg;
+			break;
+		case 'r':
+			replicate = optarg;
+			break;
+		case 'f':
+			follow = optarg;
+			break;
+		default:
+			return usage(argv[0]);
+		}
+	}
+
+	config_load(confdir, section);
+
+	if (db_path)
+		config.db_path = db_path;
+	if (replicate)
+		config.replicate = replicate;
+	if (follow)
+		config_follow(follow);
 
 	uloop_init();
 
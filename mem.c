@@ -0,0 +1,155 @@
+/*
+ * Copyright (C) 2022 John Crispin <john@phrozen.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+
+#include "db.h"
+
+/*
+ * SQLite can be handed fixed arenas up front instead of going through the
+ * system allocator for every statement and page. This has to happen
+ * before the library gets initialised, so mem_setup() runs first thing in
+ * db_start(). The arenas are allocated once and live as long as the
+ * process does.
+ */
+
+/* pages are only taken from the arena when they fit, bigger ones overflow to the heap */
+#define MEM_PAGE_SIZE		4096
+
+/* smallest chunk the SQLITE_CONFIG_HEAP allocator hands out */
+#define MEM_HEAP_MIN_ALLOC	64
+
+static struct {
+	int done;
+	void *heap;
+	void *pagecache;
+} mem;
+
+static void
+mem_heap(void)
+{
+	mem.heap = malloc(config.sqlite_heap);
+	if (!mem.heap)
+		return;
+
+	/* only available when SQLite was built with SQLITE_ENABLE_MEMSYS5 */
+	if (sqlite3_config(SQLITE_CONFIG_HEAP, mem.heap, config.sqlite_heap, MEM_HEAP_MIN_ALLOC) != SQLITE_OK) {
+		ulog(LOG_ERR, "SQLite has no heap allocator, using the system one\n");
+		free(mem.heap);
+		mem.heap = NULL;
+	}
+}
+
+static void
+mem_pagecache(void)
+{
+	int hdr = 0, sz;
+
+	sqlite3_config(SQLITE_CONFIG_PCACHE_HDRSZ, &hdr);
+	sz = MEM_PAGE_SIZE + hdr;
+
+	mem.pagecache = malloc((size_t) sz * config.sqlite_pagecache);
+	if (!mem.pagecache)
+		return;
+
+	if (sqlite3_config(SQLITE_CONFIG_PAGECACHE, mem.pagecache, sz, config.sqlite_pagecache) != SQLITE_OK) {
+		ulog(LOG_ERR, "Cannot set up the SQLite page cache arena\n");
+		free(mem.pagecache);
+		mem.pagecache = NULL;
+	}
+}
+
+void
+mem_setup(void)
+{
+	if (mem.done)
+		return;
+	mem.done = 1;
+
+	sqlite3_config(SQLITE_CONFIG_MEMSTATUS, 1);
+
+	if (config.sqlite_heap)
+		mem_heap();
+
+	if (config.sqlite_pagecache)
+		mem_pagecache();
+
+	if (config.lookaside_size && config.lookaside_slots &&
+	    sqlite3_config(SQLITE_CONFIG_LOOKASIDE, config.lookaside_size, config.lookaside_slots) != SQLITE_OK)
+		ulog(LOG_ERR, "Cannot configure the SQLite lookaside\n");
+
+	if (sqlite3_initialize() != SQLITE_OK)
+		ulog(LOG_ERR, "Cannot initialise SQLite\n");
+}
+
+static void
+mem_status(struct blob_buf *b, char *name, int op)
+{
+	sqlite3_int64 cur = 0, peak = 0;
+	void *c;
+
+	sqlite3_status64(op, &cur, &peak, 0);
+
+	c = blobmsg_open_table(b, name);
+	blobmsg_add_u64(b, "current", cur);
+	blobmsg_add_u64(b, "peak", peak);
+	blobmsg_close_table(b, c);
+}
+
+static void
+mem_db_status(struct blob_buf *b, sqlite3 *h, char *name, int op)
+{
+	int cur = 0, peak = 0;
+	void *c;
+
+	sqlite3_db_status(h, op, &cur, &peak, 0);
+
+	c = blobmsg_open_table(b, name);
+	blobmsg_add_u64(b, "current", cur);
+	blobmsg_add_u64(b, "peak", peak);
+	blobmsg_close_table(b, c);
+}
+
+void
+mem_stats(struct blob_buf *b)
+{
+	void *c;
+	int i;
+
+	blobmsg_add_u64(b, "heap", mem.heap ? config.sqlite_heap : 0);
+	blobmsg_add_u32(b, "pagecache", mem.pagecache ? config.sqlite_pagecache : 0);
+
+	mem_status(b, "used", SQLITE_STATUS_MEMORY_USED);
+	mem_status(b, "allocations", SQLITE_STATUS_MALLOC_COUNT);
+	mem_status(b, "largest", SQLITE_STATUS_MALLOC_SIZE);
+	mem_status(b, "pagecache_used", SQLITE_STATUS_PAGECACHE_USED);
+	mem_status(b, "pagecache_overflow", SQLITE_STATUS_PAGECACHE_OVERFLOW);
+
+	for (i = 0; i < __DB_MAX; i++) {
+		sqlite3 *h = db_handle[i];
+
+		if (!h || (i != DB_MAIN && h == db))
+			continue;
+
+		c = blobmsg_open_table(b, db_names[i]);
+		mem_db_status(b, h, "lookaside_used", SQLITE_DBSTATUS_LOOKASIDE_USED);
+		mem_db_status(b, h, "lookaside_hit", SQLITE_DBSTATUS_LOOKASIDE_HIT);
+		mem_db_status(b, h, "lookaside_miss_size", SQLITE_DBSTATUS_LOOKASIDE_MISS_SIZE);
+		mem_db_status(b, h, "lookaside_miss_full", SQLITE_DBSTATUS_LOOKASIDE_MISS_FULL);
+		mem_db_status(b, h, "cache_used", SQLITE_DBSTATUS_CACHE_USED);
+		blobmsg_close_table(b, c);
+	}
+}
@@ -0,0 +1,192 @@
+/*
+ * Copyright (C) 2022 John Crispin <john@phrozen.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <time.h>
+
+#include <libubox/avl.h>
+#include <libubox/avl-cmp.h>
+#include <libubox/uloop.h>
+
+#include "db.h"
+
+/* idle serials get forgotten after this long */
+#define RATELIMIT_GC_INTERVAL	60
+
+/* serials beyond this many share a single overflow bucket */
+#define RATELIMIT_MAX_SERIALS	1024
+
+static const char * const ratelimit_names[__RATELIMIT_MAX] = {
+	[RATELIMIT_STATE] = "state",
+	[RATELIMIT_HEALTH] = "health",
+	[RATELIMIT_EVENT] = "event",
+};
+
+/* tokens are kept in 1/1000 units so the refill can run off a ms clock */
+struct ratelimit_bucket {
+	uint64_t tokens;
+	uint64_t last;
+};
+
+struct ratelimit_serial {
+	struct avl_node avl;
+
+	struct ratelimit_bucket bucket[__RATELIMIT_MAX];
+	uint64_t drops[__RATELIMIT_MAX];
+	uint64_t last;
+};
+
+static void ratelimit_gc_cb(struct uloop_timeout *t);
+
+static AVL_TREE(ratelimit_tree, avl_strcmp, false, NULL);
+static struct uloop_timeout ratelimit_gc = {
+	.cb = ratelimit_gc_cb,
+};
+static struct ratelimit_serial ratelimit_overflow;
+static uint64_t ratelimit_drops[__RATELIMIT_MAX];
+
+static uint64_t
+ratelimit_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static struct ratelimit_serial *
+ratelimit_serial_get(char *serial, uint64_t now)
+{
+	struct ratelimit_serial *rl;
+	char *_serial;
+	int i;
+
+	rl = avl_find_element(&ratelimit_tree, serial, rl, avl);
+	if (rl)
+		return rl;
+
+	/* random serials must not grow the tree without bound */
+	if (ratelimit_tree.count >= RATELIMIT_MAX_SERIALS) {
+		rl = &ratelimit_overflow;
+		if (!rl->last)
+			for (i = 0; i < __RATELIMIT_MAX; i++) {
+				rl->bucket[i].tokens = config.burst[i] * 1000ULL;
+				rl->bucket[i].last = now;
+			}
+		return rl;
+	}
+
+	rl = calloc_a(sizeof(*rl), &_serial, strlen(serial) + 1);
+	if (!rl)
+		return NULL;
+
+	rl->avl.key = strcpy(_serial, serial);
+	for (i = 0; i < __RATELIMIT_MAX; i++) {
+		rl->bucket[i].tokens = config.burst[i] * 1000ULL;
+		rl->bucket[i].last = now;
+	}
+	avl_insert(&ratelimit_tree, &rl->avl);
+
+	if (!ratelimit_gc.pending)
+		uloop_timeout_set(&ratelimit_gc, RATELIMIT_GC_INTERVAL * 1000);
+
+	return rl;
+}
+
+/* returns 0 if the call may go ahead, otherwise the ms until the next token is due */
+int
+ratelimit_check(char *serial, int method)
+{
+	struct ratelimit_bucket *bucket;
+	struct ratelimit_serial *rl;
+	uint64_t now, max;
+
+	if (!config.rate[method])
+		return 0;
+
+	now = ratelimit_now();
+	rl = ratelimit_serial_get(serial ? serial : "", now);
+	if (!rl)
+		return 0;
+
+	rl->last = now;
+	bucket = &rl->bucket[method];
+	max = config.burst[method] * 1000ULL;
+
+	bucket->tokens += (now - bucket->last) * config.rate[method];
+	if (bucket->tokens > max)
+		bucket->tokens = max;
+	bucket->last = now;
+
+	if (bucket->tokens < 1000) {
+		rl->drops[method]++;
+		ratelimit_drops[method]++;
+		return (1000 - bucket->tokens + config.rate[method] - 1) / config.rate[method];
+	}
+	bucket->tokens -= 1000;
+
+	return 0;
+}
+
+static void
+ratelimit_gc_cb(struct uloop_timeout *t)
+{
+	struct ratelimit_serial *rl, *tmp;
+	uint64_t now = ratelimit_now();
+
+	avl_for_each_element_safe(&ratelimit_tree, rl, avl, tmp) {
+		if (now - rl->last < RATELIMIT_GC_INTERVAL * 1000)
+			continue;
+
+		avl_delete(&ratelimit_tree, &rl->avl);
+		free(rl);
+	}
+
+	if (!avl_is_empty(&ratelimit_tree))
+		uloop_timeout_set(t, RATELIMIT_GC_INTERVAL * 1000);
+}
+
+void
+ratelimit_stats(struct blob_buf *b)
+{
+	struct ratelimit_serial *rl;
+	void *c, *d;
+	int i;
+
+	c = blobmsg_open_table(b, "total");
+	for (i = 0; i < __RATELIMIT_MAX; i++)
+		blobmsg_add_u64(b, ratelimit_names[i], ratelimit_drops[i]);
+	blobmsg_close_table(b, c);
+
+	blobmsg_add_u32(b, "tracked", ratelimit_tree.count);
+
+	/* per serial drops only cover serials that are still tracked */
+	c = blobmsg_open_table(b, "drops");
+	avl_for_each_element(&ratelimit_tree, rl, avl) {
+		uint64_t drops = 0;
+
+		for (i = 0; i < __RATELIMIT_MAX; i++)
+			drops += rl->drops[i];
+		if (!drops)
+			continue;
+
+		d = blobmsg_open_table(b, rl->avl.key);
+		for (i = 0; i < __RATELIMIT_MAX; i++)
+			blobmsg_add_u64(b, ratelimit_names[i], rl->drops[i]);
+		blobmsg_close_table(b, d);
+	}
+	blobmsg_close_table(b, c);
+}
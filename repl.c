@@ -0,0 +1,562 @@
+/*
+ * Copyright (C) 2022 John Crispin <john@phrozen.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <libubox/uloop.h>
+#include <libubox/usock.h>
+
+#include "db.h"
+
+/*
+ * A primary records the changes made to its persistent files with one
+ * session per connection. Every REPL_INTERVAL the collected changes are
+ * turned into a changeset and written to the follower's UNIX socket,
+ * prefixed by a small header naming the family the connection belongs
+ * to. The frames are queued and written whenever the socket takes them,
+ * so a follower busy applying a changeset never holds up ingest, and no
+ * new changesets are cut until the queue has drained. While no follower
+ * is connected the sessions keep accumulating, so it catches up with one
+ * combined changeset once it is back.
+ *
+ * A follower listens on that socket and applies whatever it receives to
+ * its own files. It does not write anything on its own, it has no hot
+ * tier, FTS index or budget and only serves the read-only methods.
+ */
+
+#define REPL_INTERVAL		1000
+#define REPL_RECONNECT		5000
+
+/* seconds the last changes may take to go out on shutdown */
+#define REPL_STOP_TIMEOUT	5
+
+/* changes pending for a follower that stays away for too long are dropped */
+#define REPL_MAX_PENDING	(16 * 1024 * 1024)
+
+/* the largest changeset a follower accepts */
+#define REPL_MAX_FRAME		(64 * 1024 * 1024)
+
+struct repl_hdr {
+	uint32_t len;
+	uint32_t idx;
+};
+
+static void repl_flush_cb(struct uloop_timeout *t);
+static void repl_write_cb(struct uloop_fd *fd, unsigned int events);
+static void repl_accept_cb(struct uloop_fd *fd, unsigned int events);
+static void repl_read_cb(struct uloop_fd *fd, unsigned int events);
+
+static struct {
+	sqlite3_session *session[__DB_MAX];
+	struct uloop_timeout timeout;
+	struct uloop_fd conn;
+	uint8_t *out;
+	size_t out_len;
+	size_t out_pos;
+	size_t out_size;
+
+	struct uloop_fd server;
+	struct uloop_fd client;
+	uint8_t *buf;
+	size_t len;
+	size_t size;
+
+	uint64_t changesets;
+	uint64_t bytes;
+	uint64_t conflicts;
+	uint64_t dropped;
+} repl = {
+	.timeout.cb = repl_flush_cb,
+	.conn.cb = repl_write_cb,
+	.conn.fd = -1,
+	.server.cb = repl_accept_cb,
+	.server.fd = -1,
+	.client.cb = repl_read_cb,
+	.client.fd = -1,
+};
+
+static int
+repl_distinct(int idx)
+{
+	return idx == DB_MAIN || (db_handle[idx] && db_handle[idx] != db);
+}
+
+/* the FTS index is derived data and a follower does not keep one */
+static int
+repl_filter(void *ctx, const char *table)
+{
+	return strncmp(table, "event_fts", 9) && strncmp(table, "sqlite_", 7);
+}
+
+/*
+ * the session extension silently skips tables without a primary key, so
+ * neither side may run with one that would then never be replicated
+ */
+static int
+repl_keyed(int idx)
+{
+	sqlite3_stmt *stmt;
+	int rc;
+
+	db_prepare_on(db_handle[idx], rc, stmt,
+		      "SELECT m.name FROM sqlite_master m WHERE m.type = 'table' "
+		      "AND m.name NOT LIKE 'sqlite_%' AND m.name NOT LIKE 'event_fts%' "
+		      "AND NOT EXISTS (SELECT 1 FROM pragma_table_info(m.name) WHERE pk > 0)");
+
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		ulog(LOG_ERR, "%s.%s has no primary key and cannot be replicated\n",
+		     db_names[idx], sqlite3_column_text(stmt, 0));
+		rc = -1;
+	}
+	sqlite3_finalize(stmt);
+
+	return rc;
+}
+
+static int
+repl_session(int idx)
+{
+	sqlite3_session *s;
+	int rc;
+
+	rc = sqlite3session_create(db_handle[idx], "main", &s);
+	if (rc != SQLITE_OK) {
+		ulog(LOG_ERR, "Cannot create session: %s\n", sqlite3_errmsg(db_handle[idx]));
+		return rc;
+	}
+
+	sqlite3session_table_filter(s, repl_filter, NULL);
+	rc = sqlite3session_attach(s, NULL);
+	if (rc != SQLITE_OK) {
+		sqlite3session_delete(s);
+		return rc;
+	}
+
+	repl.session[idx] = s;
+
+	return 0;
+}
+
+static void
+repl_session_reset(int idx)
+{
+	sqlite3session_delete(repl.session[idx]);
+	repl.session[idx] = NULL;
+	repl_session(idx);
+}
+
+/* queued frames are kept, the follower drops partial ones and applying a changeset twice is harmless */
+static void
+repl_disconnect(void)
+{
+	if (repl.conn.fd < 0)
+		return;
+
+	uloop_fd_delete(&repl.conn);
+	close(repl.conn.fd);
+	repl.conn.fd = -1;
+	repl.out_pos = 0;
+}
+
+/* writes as much of the queue as the socket takes, returns -1 once the follower is gone */
+static int
+repl_drain(void)
+{
+	while (repl.out_pos < repl.out_len) {
+		ssize_t ret = send(repl.conn.fd, &repl.out[repl.out_pos],
+				   repl.out_len - repl.out_pos, MSG_NOSIGNAL);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0 && errno == EAGAIN) {
+			uloop_fd_add(&repl.conn, ULOOP_WRITE);
+			return 0;
+		}
+		if (ret <= 0)
+			return -1;
+
+		repl.out_pos += ret;
+	}
+
+	repl.out_len = repl.out_pos = 0;
+	uloop_fd_delete(&repl.conn);
+
+	return 0;
+}
+
+static void
+repl_write_cb(struct uloop_fd *fd, unsigned int events)
+{
+	if (!repl_drain())
+		return;
+
+	ulog(LOG_ERR, "lost the follower at %s\n", config.replicate);
+	repl_disconnect();
+}
+
+static int
+repl_queue(int idx)
+{
+	struct repl_hdr hdr;
+	void *changeset;
+	size_t size;
+	int len;
+
+	if (sqlite3session_isempty(repl.session[idx]))
+		return 0;
+
+	if (sqlite3session_changeset(repl.session[idx], &len, &changeset) != SQLITE_OK)
+		return -1;
+
+	size = repl.out_len + sizeof(hdr) + len;
+	if (size > repl.out_size) {
+		uint8_t *buf = realloc(repl.out, size);
+
+		/* the session is kept, its changes go out with the next flush */
+		if (!buf) {
+			sqlite3_free(changeset);
+			return -1;
+		}
+		repl.out = buf;
+		repl.out_size = size;
+	}
+
+	hdr.len = htonl(len);
+	hdr.idx = htonl(idx);
+	memcpy(&repl.out[repl.out_len], &hdr, sizeof(hdr));
+	memcpy(&repl.out[repl.out_len + sizeof(hdr)], changeset, len);
+	repl.out_len = size;
+	sqlite3_free(changeset);
+
+	repl.changesets++;
+	repl.bytes += len;
+	repl_session_reset(idx);
+
+	return 0;
+}
+
+static int64_t
+repl_pending(void)
+{
+	int64_t pending = repl.out_len;
+	int i;
+
+	for (i = 0; i < __DB_MAX; i++)
+		if (repl.session[i])
+			pending += sqlite3session_memory_used(repl.session[i]);
+
+	return pending;
+}
+
+static void
+repl_connect(void)
+{
+	repl.conn.fd = usock(USOCK_UNIX | USOCK_NONBLOCK, config.replicate, NULL);
+	if (repl.conn.fd >= 0)
+		ulog(LOG_INFO, "replicating to %s\n", config.replicate);
+}
+
+static void
+repl_flush(void)
+{
+	int i;
+
+	if (repl.conn.fd < 0)
+		repl_connect();
+
+	if (repl.conn.fd < 0) {
+		if (repl_pending() <= REPL_MAX_PENDING)
+			return;
+
+		/* the follower has to be seeded from a backup before it can follow again */
+		ulog(LOG_ERR, "follower unreachable, dropping pending changes\n");
+		for (i = 0; i < __DB_MAX; i++)
+			if (repl.session[i])
+				repl_session_reset(i);
+		repl.out_len = repl.out_pos = 0;
+		repl.dropped++;
+		return;
+	}
+
+	/* a follower that is still busy with the last batch gets the sessions combined later */
+	if (!repl.out_len)
+		for (i = 0; i < __DB_MAX; i++)
+			if (repl.session[i])
+				repl_queue(i);
+
+	repl_write_cb(&repl.conn, ULOOP_WRITE);
+}
+
+static void
+repl_flush_cb(struct uloop_timeout *t)
+{
+	repl_flush();
+	uloop_timeout_set(t, repl.conn.fd < 0 ? REPL_RECONNECT : REPL_INTERVAL);
+}
+
+static int
+repl_conflict(void *ctx, int conflict, sqlite3_changeset_iter *iter)
+{
+	repl.conflicts++;
+
+	/* the primary is always right, rows that are already gone stay gone */
+	if (conflict == SQLITE_CHANGESET_DATA || conflict == SQLITE_CHANGESET_CONFLICT)
+		return SQLITE_CHANGESET_REPLACE;
+
+	return SQLITE_CHANGESET_OMIT;
+}
+
+static void
+repl_apply(uint32_t idx, uint8_t *data, uint32_t len)
+{
+	if (idx >= __DB_MAX || !db_handle[idx]) {
+		ulog(LOG_ERR, "changeset for unknown database %u\n", idx);
+		return;
+	}
+
+	/* a changeset can touch any table and serial */
+	cache_invalidate();
+
+	if (sqlite3changeset_apply(db_handle[idx], len, data, NULL, repl_conflict, NULL) != SQLITE_OK) {
+		ulog(LOG_ERR, "Cannot apply changeset: %s\n", sqlite3_errmsg(db_handle[idx]));
+		return;
+	}
+
+	repl.changesets++;
+	repl.bytes += len;
+}
+
+static void
+repl_client_close(void)
+{
+	if (repl.client.fd < 0)
+		return;
+
+	uloop_fd_delete(&repl.client);
+	close(repl.client.fd);
+	repl.client.fd = -1;
+	repl.len = 0;
+}
+
+/* consumes all complete frames, a partial one stays at the start of the buffer */
+static int
+repl_parse(void)
+{
+	size_t pos = 0;
+
+	while (repl.len - pos >= sizeof(struct repl_hdr)) {
+		struct repl_hdr *hdr = (struct repl_hdr *) &repl.buf[pos];
+		uint32_t len = ntohl(hdr->len);
+
+		if (len > REPL_MAX_FRAME)
+			return -1;
+		if (repl.len - pos < sizeof(*hdr) + len)
+			break;
+
+		repl_apply(ntohl(hdr->idx), &repl.buf[pos + sizeof(*hdr)], len);
+		pos += sizeof(*hdr) + len;
+	}
+
+	memmove(repl.buf, &repl.buf[pos], repl.len - pos);
+	repl.len -= pos;
+
+	return 0;
+}
+
+static void
+repl_read_cb(struct uloop_fd *fd, unsigned int events)
+{
+	while (1) {
+		ssize_t ret;
+
+		if (repl.size - repl.len < 4096) {
+			size_t size = repl.size ? repl.size * 2 : 65536;
+			uint8_t *buf = NULL;
+
+			if (size <= REPL_MAX_FRAME + 2 * sizeof(struct repl_hdr))
+				buf = realloc(repl.buf, size);
+			if (!buf) {
+				ulog(LOG_ERR, "changeset too large, dropping the primary\n");
+				repl_client_close();
+				return;
+			}
+			repl.buf = buf;
+			repl.size = size;
+		}
+
+		ret = read(fd->fd, &repl.buf[repl.len], repl.size - repl.len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0 && errno == EAGAIN)
+			break;
+		if (ret <= 0) {
+			ulog(LOG_INFO, "primary disconnected\n");
+			repl_client_close();
+			return;
+		}
+
+		repl.len += ret;
+	}
+
+	if (repl_parse()) {
+		ulog(LOG_ERR, "invalid changeset frame, dropping the primary\n");
+		repl_client_close();
+	}
+}
+
+static void
+repl_accept_cb(struct uloop_fd *fd, unsigned int events)
+{
+	int client = accept(fd->fd, NULL, NULL);
+
+	if (client < 0)
+		return;
+
+	fcntl(client, F_SETFL, fcntl(client, F_GETFL) | O_NONBLOCK);
+	fcntl(client, F_SETFD, FD_CLOEXEC);
+
+	/* there is only ever one primary, a new connection replaces the old one */
+	repl_client_close();
+
+	ulog(LOG_INFO, "primary connected\n");
+	repl.client.fd = client;
+	uloop_fd_add(&repl.client, ULOOP_READ);
+}
+
+static int
+repl_listen(void)
+{
+	unlink(config.follow);
+
+	repl.server.fd = usock(USOCK_UNIX | USOCK_SERVER | USOCK_NONBLOCK, config.follow, NULL);
+	if (repl.server.fd < 0) {
+		ulog(LOG_ERR, "Cannot listen on %s\n", config.follow);
+		return -1;
+	}
+
+	uloop_fd_add(&repl.server, ULOOP_READ);
+
+	return 0;
+}
+
+int
+repl_start(void)
+{
+	int i, rc;
+
+	if (!config.follow && !config.replicate)
+		return 0;
+
+	for (i = 0; i < __DB_MAX; i++) {
+		if (!repl_distinct(i))
+			continue;
+
+		rc = repl_keyed(i);
+		if (rc)
+			return rc;
+	}
+
+	if (config.follow)
+		return repl_listen();
+
+	for (i = 0; i < __DB_MAX; i++) {
+		if (!repl_distinct(i))
+			continue;
+
+		rc = repl_session(i);
+		if (rc)
+			return rc;
+	}
+
+	uloop_timeout_set(&repl.timeout, 0);
+
+	return 0;
+}
+
+void
+repl_stop(void)
+{
+	int i;
+
+	uloop_timeout_cancel(&repl.timeout);
+
+	/*
+	 * hand over whatever is left, sessions have to be gone before their
+	 * connection is closed. Ingest is over, so this may block for a bit.
+	 */
+	if (config.replicate && repl.conn.fd >= 0) {
+		struct timeval tv = { .tv_sec = REPL_STOP_TIMEOUT };
+
+		for (i = 0; i < __DB_MAX; i++)
+			if (repl.session[i])
+				repl_queue(i);
+
+		fcntl(repl.conn.fd, F_SETFL, fcntl(repl.conn.fd, F_GETFL) & ~O_NONBLOCK);
+		setsockopt(repl.conn.fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		if (repl_drain() || repl.out_len)
+			ulog(LOG_ERR, "could not hand the last changes over to %s\n", config.replicate);
+	}
+	repl_disconnect();
+	free(repl.out);
+	repl.out = NULL;
+	repl.out_len = repl.out_pos = repl.out_size = 0;
+
+	for (i = 0; i < __DB_MAX; i++) {
+		if (repl.session[i])
+			sqlite3session_delete(repl.session[i]);
+		repl.session[i] = NULL;
+	}
+
+	repl_client_close();
+	if (repl.server.fd >= 0) {
+		uloop_fd_delete(&repl.server);
+		close(repl.server.fd);
+		repl.server.fd = -1;
+	}
+
+	free(repl.buf);
+	repl.buf = NULL;
+	repl.len = repl.size = 0;
+}
+
+void
+repl_status(struct blob_buf *b)
+{
+	if (config.follow) {
+		blobmsg_add_string(b, "role", "follower");
+		blobmsg_add_u8(b, "connected", repl.client.fd >= 0);
+		blobmsg_add_u64(b, "conflicts", repl.conflicts);
+	} else if (config.replicate) {
+		blobmsg_add_string(b, "role", "primary");
+		blobmsg_add_u8(b, "connected", repl.conn.fd >= 0);
+		blobmsg_add_u64(b, "pending", repl_pending());
+		blobmsg_add_u64(b, "queued", repl.out_len - repl.out_pos);
+		blobmsg_add_u64(b, "dropped", repl.dropped);
+	} else {
+		blobmsg_add_string(b, "role", "none");
+		return;
+	}
+
+	blobmsg_add_u64(b, "changesets", repl.changesets);
+	blobmsg_add_u64(b, "bytes", repl.bytes);
+}
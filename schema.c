@@ -0,0 +1,580 @@
+/*
+ * Copyright (C) 2022 John Crispin <john@phrozen.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "db.h"
+
+/*
+ * Table layout, migrations and the statement helpers every unit uses.
+ * Kept apart from the daemon's lifecycle in db.c so that uCollect-import
+ * can create and upgrade a file without linking the rest of the daemon.
+ */
+
+#define TABLE_DEVICE							\
+	"CREATE TABLE IF NOT EXISTS device ("				\
+	"serial		VARCHAR(30) UNIQUE PRIMARY KEY NOT NULL,"	\
+	"compatible    	VARCHAR(32) NOT NULL,"				\
+	"created	BIGINT NOT NULL,"				\
+	"modified	BIGINT NOT NULL"				\
+	")"
+
+#define INDEX_DEVICE	"CREATE INDEX IF NOT EXISTS device_index ON device(serial)"
+
+/* device only exists in main, families split off into a file of their own go without the key */
+#define DEVICE_FK	",FOREIGN KEY(serial) REFERENCES device(serial)"
+
+#define TABLE_STATE(fk)							\
+	"CREATE TABLE IF NOT EXISTS state ("				\
+	"id		INTEGER PRIMARY KEY,"				\
+	"serial		VARCHAR(30) NOT NULL,"				\
+	"state		BLOB NOT NULL,"					\
+	"timestamp	BIGINT NOT NULL"				\
+	fk								\
+	")"
+
+#define INDEX_STATE	"CREATE INDEX IF NOT EXISTS state_index ON state(serial, timestamp)"
+
+#define TABLE_HEALTH(fk)						\
+	"CREATE TABLE IF NOT EXISTS health ("				\
+	"id		INTEGER PRIMARY KEY,"				\
+	"serial		VARCHAR(30) NOT NULL,"				\
+	"health		BLOB NOT NULL,"					\
+	"timestamp	BIGINT NOT NULL"				\
+	fk								\
+	")"
+
+#define INDEX_HEALTH	"CREATE INDEX IF NOT EXISTS health_index ON health(serial, timestamp)"
+
+#define TABLE_EVENT(fk)							\
+	"CREATE TABLE IF NOT EXISTS event ("				\
+	"id		INTEGER PRIMARY KEY,"				\
+	"type		VARCHAR(30) NOT NULL,"				\
+	"serial		VARCHAR(30),"					\
+	"client		VARCHAR(64),"					\
+	"event		TEXT,"						\
+	"timestamp	BIGINT NOT NULL"				\
+	fk								\
+	")"
+
+#define INDEX_EVENT_TYPE	"CREATE INDEX IF NOT EXISTS event_type_index ON event(type)"
+#define INDEX_EVENT_SERIAL	"CREATE INDEX IF NOT EXISTS event_serial_index ON event(serial, timestamp)"
+
+/* serial is '' for events without one, NULLs would never conflict on the key */
+#define TABLE_EVENT_COUNTER						\
+	"CREATE TABLE IF NOT EXISTS event_counter ("			\
+	"type		VARCHAR(30) NOT NULL,"				\
+	"serial		VARCHAR(30) NOT NULL,"				\
+	"bucket		BIGINT NOT NULL,"				\
+	"count		INTEGER NOT NULL,"				\
+	"PRIMARY KEY(type, serial, bucket)"				\
+	") WITHOUT ROWID"
+
+#define INDEX_EVENT_COUNTER	"CREATE INDEX IF NOT EXISTS event_counter_serial_index ON event_counter(serial, bucket)"
+
+#define TABLE_BLOB_STORE						\
+	"CREATE TABLE IF NOT EXISTS blob_store ("			\
+	"hash		BLOB PRIMARY KEY NOT NULL,"			\
+	"data		BLOB NOT NULL,"					\
+	"refs		INTEGER NOT NULL"				\
+	")"
+
+/* rows referencing a payload by hash keep its refs up to date */
+#define TRIGGER_BLOB_STORE(t)											\
+	"CREATE TRIGGER IF NOT EXISTS " t "_blob_ref AFTER INSERT ON " t " WHEN NEW.hash IS NOT NULL BEGIN "	\
+	"UPDATE blob_store SET refs = refs + 1 WHERE hash = NEW.hash; END;"					\
+	"CREATE TRIGGER IF NOT EXISTS " t "_blob_unref AFTER DELETE ON " t " WHEN OLD.hash IS NOT NULL BEGIN "	\
+	"UPDATE blob_store SET refs = refs - 1 WHERE hash = OLD.hash; "						\
+	"DELETE FROM blob_store WHERE hash = OLD.hash AND refs <= 0; END"
+
+#define TABLE_EVENT_FTS							\
+	"CREATE VIRTUAL TABLE event_fts USING fts5("			\
+	"event, content='event', content_rowid='rowid'"			\
+	")"
+
+/*
+ * state and health can either be rowid tables with an index on (serial,
+ * timestamp), or WITHOUT ROWID tables clustered on (serial, timestamp,
+ * seq) which keep each device's rows on adjacent pages. seq only tells
+ * apart rows of the same device and second. Switching rebuilds the table.
+ *
+ * Either way every table has a primary key, the session extension only
+ * records changes to tables that have one. Rowid tables get theirs as an
+ * id alias of the rowid, files from before that get rebuilt once.
+ */
+#define LAYOUT_CLUSTERED(t, fk)									\
+	"CREATE TABLE " t "_layout ("								\
+	"serial VARCHAR(30) NOT NULL, " t " BLOB NOT NULL, timestamp BIGINT NOT NULL, "	\
+	"hash BLOB, seq INTEGER NOT NULL, PRIMARY KEY(serial, timestamp, seq)" fk ") WITHOUT ROWID;"	\
+	"INSERT INTO " t "_layout (serial, " t ", timestamp, hash, seq) "			\
+	"SELECT serial, " t ", timestamp, hash, rowid FROM " t ";"				\
+	"DROP TABLE " t ";"									\
+	"ALTER TABLE " t "_layout RENAME TO " t
+
+#define LAYOUT_ROWID(t, fk)									\
+	"CREATE TABLE " t "_layout (id INTEGER PRIMARY KEY, "					\
+	"serial VARCHAR(30) NOT NULL, " t " BLOB NOT NULL, timestamp BIGINT NOT NULL, "	\
+	"hash BLOB, seq INTEGER NOT NULL DEFAULT 0" fk ");"					\
+	"INSERT INTO " t "_layout (serial, " t ", timestamp, hash, seq) "			\
+	"SELECT serial, " t ", timestamp, hash, seq FROM " t " ORDER BY timestamp, seq;"	\
+	"DROP TABLE " t ";"									\
+	"ALTER TABLE " t "_layout RENAME TO " t
+
+/* events keep their rowids, the fts index and pending repeats refer to them */
+#define LAYOUT_EVENT(fk)									\
+	"CREATE TABLE event_layout (id INTEGER PRIMARY KEY, "					\
+	"type VARCHAR(30) NOT NULL, serial VARCHAR(30), client VARCHAR(64), event TEXT, "	\
+	"timestamp BIGINT NOT NULL, last_seen BIGINT, count INTEGER NOT NULL DEFAULT 1" fk ");"	\
+	"INSERT INTO event_layout (id, type, serial, client, event, timestamp, last_seen, count) "	\
+	"SELECT rowid, type, serial, client, event, timestamp, last_seen, count FROM event;"	\
+	"DROP TABLE event;"									\
+	"ALTER TABLE event_layout RENAME TO event"
+
+/* eviction and purges look for the oldest rows, which the clustered key cannot find */
+#define INDEX_CLUSTERED(t)	"CREATE INDEX IF NOT EXISTS " t "_timestamp_index ON " t "(timestamp)"
+
+#define FOREIGN_KEYS	"PRAGMA foreign_keys = ON"
+
+/*
+ * schema changes on top of the tables above, indexed by PRAGMA user_version.
+ * Each file only gets the parts for the families it holds.
+ */
+struct db_migration {
+	char *sql[__DB_MAX];
+};
+
+static const struct db_migration db_migrations[] = {
+	/* 1: event coalescing */
+	{
+		.sql[DB_EVENT] = "ALTER TABLE event ADD COLUMN last_seen BIGINT;"
+				 "ALTER TABLE event ADD COLUMN count INTEGER NOT NULL DEFAULT 1;",
+	},
+	/* 2: device last_seen */
+	{
+		.sql[DB_MAIN] = "ALTER TABLE device ADD COLUMN last_seen BIGINT;",
+	},
+	/* 3: device change sequence */
+	{
+		.sql[DB_MAIN] = "ALTER TABLE device ADD COLUMN seq BIGINT NOT NULL DEFAULT 0;"
+				"CREATE INDEX IF NOT EXISTS device_seq_index ON device(seq);"
+				"CREATE TABLE IF NOT EXISTS device_tombstone ("
+				"serial VARCHAR(30) PRIMARY KEY NOT NULL, seq BIGINT NOT NULL);"
+				"CREATE INDEX IF NOT EXISTS device_tombstone_seq_index ON device_tombstone(seq);",
+	},
+	/* 4: per device indexes also cover the timestamp */
+	{
+		.sql[DB_STATE] = "DROP INDEX IF EXISTS state_index;" INDEX_STATE ";",
+		.sql[DB_HEALTH] = "DROP INDEX IF EXISTS health_index;" INDEX_HEALTH ";",
+		.sql[DB_EVENT] = "DROP INDEX IF EXISTS event_serial_index;" INDEX_EVENT_SERIAL ";",
+	},
+	/* 5: per type/serial/bucket event counters, seeded from the existing rows */
+	{
+		.sql[DB_EVENT] = TABLE_EVENT_COUNTER ";"
+				 INDEX_EVENT_COUNTER ";"
+				 "INSERT INTO event_counter (type, serial, bucket, count) "
+				 "SELECT type, IFNULL(serial, ''), timestamp - timestamp % " db_str(EVENT_COUNT_BUCKET) ", SUM(count) "
+				 "FROM event GROUP BY 1, 2, 3;",
+	},
+	/* 6: content addressed state/health payloads, the store sits next to the rows referencing it */
+	{
+		.sql[DB_STATE] = "ALTER TABLE state ADD COLUMN hash BLOB;"
+				 TABLE_BLOB_STORE ";"
+				 TRIGGER_BLOB_STORE("state") ";",
+		.sql[DB_HEALTH] = "ALTER TABLE health ADD COLUMN hash BLOB;"
+				  TABLE_BLOB_STORE ";"
+				  TRIGGER_BLOB_STORE("health") ";",
+	},
+	/* 7: tie breaker for the clustered layout */
+	{
+		.sql[DB_STATE] = "ALTER TABLE state ADD COLUMN seq INTEGER NOT NULL DEFAULT 0;",
+		.sql[DB_HEALTH] = "ALTER TABLE health ADD COLUMN seq INTEGER NOT NULL DEFAULT 0;",
+	},
+};
+
+/* [1] is used when the family has a file of its own */
+struct db_layout {
+	int idx;
+	char *table;
+	char *clustered[2];
+	char *rowid[2];
+	char *index_clustered;
+	char *index_rowid;
+};
+
+static const struct db_layout db_layouts[] = {
+	{
+		.idx = DB_STATE,
+		.table = "state",
+		.clustered = { LAYOUT_CLUSTERED("state", DEVICE_FK), LAYOUT_CLUSTERED("state", "") },
+		.rowid = { LAYOUT_ROWID("state", DEVICE_FK), LAYOUT_ROWID("state", "") },
+		.index_clustered = INDEX_CLUSTERED("state"),
+		.index_rowid = INDEX_STATE,
+	}, {
+		.idx = DB_HEALTH,
+		.table = "health",
+		.clustered = { LAYOUT_CLUSTERED("health", DEVICE_FK), LAYOUT_CLUSTERED("health", "") },
+		.rowid = { LAYOUT_ROWID("health", DEVICE_FK), LAYOUT_ROWID("health", "") },
+		.index_clustered = INDEX_CLUSTERED("health"),
+		.index_rowid = INDEX_HEALTH,
+	}, {
+		/* events are never clustered */
+		.idx = DB_EVENT,
+		.table = "event",
+		.rowid = { LAYOUT_EVENT(DEVICE_FK), LAYOUT_EVENT("") },
+		.index_rowid = INDEX_EVENT_TYPE ";" INDEX_EVENT_SERIAL,
+	},
+};
+
+/* [1] is used when the family has a file of its own */
+struct db_schema {
+	char *table[2];
+	char *index[3];
+};
+
+static const struct db_schema db_schemas[__DB_MAX] = {
+	[DB_MAIN] = {
+		.table = { TABLE_DEVICE },
+		.index = { INDEX_DEVICE },
+	},
+	[DB_STATE] = {
+		.table = { TABLE_STATE(DEVICE_FK), TABLE_STATE("") },
+	},
+	[DB_HEALTH] = {
+		.table = { TABLE_HEALTH(DEVICE_FK), TABLE_HEALTH("") },
+	},
+	[DB_EVENT] = {
+		.table = { TABLE_EVENT(DEVICE_FK), TABLE_EVENT("") },
+		.index = { INDEX_EVENT_TYPE, INDEX_EVENT_SERIAL },
+	},
+};
+
+/* the main file holds device and every family that is not split off */
+static int
+db_holds(int idx, int family)
+{
+	if (idx == DB_MAIN)
+		return family == DB_MAIN || !config.split_path[family];
+
+	return family == idx;
+}
+
+static int
+db_create_family(sqlite3 *h, int idx, int family)
+{
+	const struct db_schema *s = &db_schemas[family];
+	unsigned int i;
+	int rc;
+
+	rc = db_exec_on(h, s->table[idx != DB_MAIN]);
+
+	for (i = 0; !rc && i < ARRAY_SIZE(s->index) && s->index[i]; i++)
+		rc = db_exec_on(h, s->index[i]);
+
+	return rc;
+}
+
+static int
+db_create_db(int idx)
+{
+	sqlite3 *h = db_handle[idx];
+	int family, rc;
+
+	rc = db_exec_on(h, "BEGIN TRANSACTION;");
+
+	for (family = 0; !rc && family < __DB_MAX; family++)
+		if (db_holds(idx, family))
+			rc = db_create_family(h, idx, family);
+
+	if (!rc && idx == DB_MAIN)
+		rc = db_exec_on(h, FOREIGN_KEYS);
+
+	if (rc) {
+		db_exec_on(h, "ROLLBACK;");
+		return rc;
+	}
+
+	return db_exec_on(h, "COMMIT;");
+}
+
+static int
+db_migrate(int idx)
+{
+	sqlite3 *h = db_handle[idx];
+	sqlite3_stmt *stmt;
+	int version = 0;
+	int family, rc;
+
+	db_prepare_on(h, rc, stmt, "PRAGMA user_version;");
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+		version = sqlite3_column_int(stmt, 0);
+	sqlite3_finalize(stmt);
+
+	for (; version < ARRAY_SIZE(db_migrations); version++) {
+		char sql[64];
+
+		snprintf(sql, sizeof(sql), "PRAGMA user_version = %d;", version + 1);
+
+		rc = db_exec_on(h, "BEGIN TRANSACTION;");
+		for (family = 0; !rc && family < __DB_MAX; family++)
+			if (db_holds(idx, family) && db_migrations[version].sql[family])
+				rc = db_exec_on(h, db_migrations[version].sql[family]);
+		if (!rc)
+			rc = db_exec_on(h, sql);
+		if (rc) {
+			db_exec_on(h, "ROLLBACK;");
+			return rc;
+		}
+		rc = db_exec_on(h, "COMMIT;");
+		if (rc)
+			return rc;
+	}
+
+	return 0;
+}
+
+static int
+db_table_exists(sqlite3 *h, char *name)
+{
+	char *sql = "SELECT 1 FROM sqlite_master WHERE type = 'table' AND name = @name";
+	sqlite3_stmt *stmt;
+	int rc;
+
+	db_prepare_on(h, rc, stmt, sql);
+
+	db_bind_text(stmt, "@name", name);
+
+	rc = sqlite3_step(stmt);
+	sqlite3_finalize(stmt);
+
+	return rc == SQLITE_ROW;
+}
+
+static int
+db_clustered(sqlite3 *h, char *name)
+{
+	char *sql = "SELECT sql LIKE '%WITHOUT ROWID' FROM sqlite_master WHERE type = 'table' AND name = @name";
+	sqlite3_stmt *stmt;
+	int rc;
+
+	db_prepare_on(h, rc, stmt, sql);
+
+	db_bind_text(stmt, "@name", name);
+
+	rc = sqlite3_step(stmt) == SQLITE_ROW ? sqlite3_column_int(stmt, 0) : -1;
+	sqlite3_finalize(stmt);
+
+	return rc;
+}
+
+static int
+db_keyed(sqlite3 *h, char *name)
+{
+	char *sql = "SELECT COUNT(*) FROM pragma_table_info(@name) WHERE pk > 0";
+	sqlite3_stmt *stmt;
+	int rc;
+
+	db_prepare_on(h, rc, stmt, sql);
+
+	db_bind_text(stmt, "@name", name);
+
+	rc = sqlite3_step(stmt) == SQLITE_ROW ? sqlite3_column_int(stmt, 0) > 0 : -1;
+	sqlite3_finalize(stmt);
+
+	return rc;
+}
+
+/* the indexes depend on the layout, db_create_db() leaves them to this */
+static int
+db_layout(int idx)
+{
+	sqlite3 *h = db_handle[idx];
+	int split = idx != DB_MAIN;
+	unsigned int i;
+	int rc;
+
+	for (i = 0; i < ARRAY_SIZE(db_layouts); i++) {
+		const struct db_layout *l = &db_layouts[i];
+		int want = config.clustered && l->clustered[0];
+		int clustered, keyed;
+
+		if (!db_holds(idx, l->idx))
+			continue;
+
+		clustered = db_clustered(h, l->table);
+		keyed = db_keyed(h, l->table);
+
+		if (clustered < 0 || keyed < 0)
+			return -1;
+
+		if (clustered != want || !keyed) {
+			ulog(LOG_INFO, "rebuilding %s as a %s table\n", l->table,
+			     want ? "clustered" : "rowid");
+
+			rc = db_exec_on(h, "BEGIN TRANSACTION;");
+			if (!rc)
+				rc = db_exec_on(h, want ? l->clustered[split] : l->rowid[split]);
+			if (rc) {
+				db_exec_on(h, "ROLLBACK;");
+				return rc;
+			}
+			rc = db_exec_on(h, "COMMIT;");
+			if (rc)
+				return rc;
+		}
+
+		rc = db_exec_on(h, want ? l->index_clustered : l->index_rowid);
+		if (rc)
+			return rc;
+	}
+
+	return 0;
+}
+
+static int
+db_triggers(int idx)
+{
+	sqlite3 *h = db_handle[idx];
+	int rc = 0;
+
+	/* a follower gets its refs replicated from the primary, counting them again would skew them */
+	if (db_holds(idx, DB_STATE))
+		rc = db_exec_on(h, config.follow ?
+				"DROP TRIGGER IF EXISTS state_blob_ref; DROP TRIGGER IF EXISTS state_blob_unref;" :
+				TRIGGER_BLOB_STORE("state"));
+
+	if (!rc && db_holds(idx, DB_HEALTH))
+		rc = db_exec_on(h, config.follow ?
+				"DROP TRIGGER IF EXISTS health_blob_ref; DROP TRIGGER IF EXISTS health_blob_unref;" :
+				TRIGGER_BLOB_STORE("health"));
+
+	return rc;
+}
+
+int
+db_fts(sqlite3 *h)
+{
+	int exists = db_table_exists(h, "event_fts");
+
+	/* a disabled index would go stale, drop it so it gets rebuilt next time */
+	if (!config.fts)
+		return exists > 0 ? db_exec_on(h, "DROP TABLE event_fts;") : 0;
+
+	if (exists)
+		return exists < 0 ? exists : 0;
+
+	if (db_exec_on(h, TABLE_EVENT_FTS))
+		return -1;
+
+	/* table payloads are binary blobmsg, only text events get indexed */
+	return db_exec_on(h, "INSERT INTO event_fts (rowid, event) SELECT rowid, event FROM event WHERE typeof(event) = 'text';");
+}
+
+/* creates or upgrades everything idx holds, the connection has to be open */
+int
+db_schema(int idx)
+{
+	int rc;
+
+	rc = db_create_db(idx);
+	if (!rc)
+		rc = db_migrate(idx);
+	if (!rc)
+		rc = db_layout(idx);
+	/* rebuilding a table drops its triggers */
+	if (!rc)
+		rc = db_triggers(idx);
+
+	return rc;
+}
+
+int
+__db_bind_text(sqlite3_stmt *stmt, char *id, char *value, const char *func, const int line)
+{
+	int idx = sqlite3_bind_parameter_index(stmt, id);
+	int rc;
+
+	if (value)
+		rc = sqlite3_bind_text(stmt, idx, value, strlen(value), NULL);
+	else
+		rc = sqlite3_bind_null(stmt, idx);
+
+	if (rc != SQLITE_OK) {
+		ulog(LOG_ERR, "SQL error (%s:%d): (%d) - %s\n", func, line, rc, sqlite3_errmsg(sqlite3_db_handle(stmt)));
+		sqlite3_finalize(stmt);
+		return -1;
+	}
+
+	return 0;
+}
+
+int
+__db_bind_int64(sqlite3_stmt *stmt, char *id, uint64_t value, const char *func, const int line)
+{
+	int idx = sqlite3_bind_parameter_index(stmt, id);
+	int rc = sqlite3_bind_int64(stmt, idx, value);
+
+	if (rc != SQLITE_OK) {
+		ulog(LOG_ERR, "SQL error (%s:%d): (%d) - %s\n", func, line, rc, sqlite3_errmsg(sqlite3_db_handle(stmt)));
+		sqlite3_finalize(stmt);
+		return -1;
+	}
+
+	return 0;
+}
+
+int
+__db_bind_blob(sqlite3_stmt *stmt, char *id, struct blob_attr *attr, const char *func, const int line)
+{
+	int idx = sqlite3_bind_parameter_index(stmt, id);
+	int rc = sqlite3_bind_blob(stmt, idx, blobmsg_data(attr), blobmsg_data_len(attr), SQLITE_STATIC);
+
+	if (rc != SQLITE_OK) {
+		ulog(LOG_ERR, "SQL error (%s:%d): (%d) - %s\n", func, line, rc, sqlite3_errmsg(sqlite3_db_handle(stmt)));
+		sqlite3_finalize(stmt);
+		return -1;
+	}
+
+	return 0;
+}
+
+int
+__db_simple(sqlite3_stmt *stmt, const char *func, const int line)
+{
+	int64_t start = slowlog_now();
+	int rc = sqlite3_step(stmt);
+
+	if (rc != SQLITE_DONE)
+		ulog(LOG_ERR, "SQL error (%s:%d): (%d) - %s\n", func, line, rc, sqlite3_errmsg(sqlite3_db_handle(stmt)));
+	else
+		slowlog_record(stmt, func, start, sqlite3_changes(sqlite3_db_handle(stmt)));
+	sqlite3_finalize(stmt);
+
+	return rc != SQLITE_DONE;
+}
+
+int
+__db_exec(sqlite3 *h, char *sql, const char *func, const int line)
+{
+	char *err_msg = 0;
+	int rc;
+
+	rc = sqlite3_exec(h, sql, 0, 0, &err_msg);
+
+	if (rc != SQLITE_OK) {
+		ulog(LOG_ERR, "SQL error (%s:%d): %s\n", func, line, err_msg);
+		sqlite3_free(err_msg);
+	}
+
+	return rc;
+}
@@ -0,0 +1,138 @@
+/*
+ * Copyright (C) 2022 John Crispin <john@phrozen.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "db.h"
+
+/*
+ * Statements run through db_select() and __db_simple() that take longer
+ * than config.slow_query milliseconds are recorded in a small ring,
+ * together with their parameters and query plan. Each record is kept as
+ * a ready to send blobmsg table, so dumping the ring is a plain copy.
+ */
+
+#define SLOWLOG_SIZE	32
+
+static struct {
+	struct blob_attr *entry[SLOWLOG_SIZE];
+	unsigned int next;
+	uint64_t total;
+	struct blob_buf b;
+} slowlog;
+
+int64_t
+slowlog_now(void)
+{
+	struct timespec ts;
+
+	if (!config.slow_query)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* the plan is looked up for the statement as it was prepared, parameters bound as NULL */
+static void
+slowlog_plan(sqlite3_stmt *stmt)
+{
+	sqlite3 *h = sqlite3_db_handle(stmt);
+	sqlite3_stmt *plan;
+	char *sql;
+	void *c;
+
+	sql = sqlite3_mprintf("EXPLAIN QUERY PLAN %s", sqlite3_sql(stmt));
+	if (!sql)
+		return;
+
+	if (sqlite3_prepare_v2(h, sql, -1, &plan, 0) != SQLITE_OK) {
+		sqlite3_free(sql);
+		return;
+	}
+	sqlite3_free(sql);
+
+	c = blobmsg_open_array(&slowlog.b, "plan");
+	while (sqlite3_step(plan) == SQLITE_ROW)
+		blobmsg_add_string(&slowlog.b, NULL, (char *) sqlite3_column_text(plan, 3));
+	blobmsg_close_array(&slowlog.b, c);
+
+	sqlite3_finalize(plan);
+}
+
+void
+slowlog_record(sqlite3_stmt *stmt, const char *func, int64_t start, int rows)
+{
+	int64_t elapsed;
+	char *expanded;
+
+	if (!config.slow_query)
+		return;
+
+	elapsed = slowlog_now() - start;
+	if (elapsed < (int64_t) config.slow_query * 1000)
+		return;
+
+	blob_buf_init(&slowlog.b, 0);
+	blobmsg_add_u64(&slowlog.b, "timestamp", time(NULL));
+	blobmsg_add_string(&slowlog.b, "function", func);
+	blobmsg_add_u64(&slowlog.b, "elapsed", elapsed);
+	blobmsg_add_u32(&slowlog.b, "rows", rows);
+	blobmsg_add_string(&slowlog.b, "sql", sqlite3_sql(stmt));
+
+	/* the statement text with the bound parameters filled in */
+	expanded = sqlite3_expanded_sql(stmt);
+	if (expanded) {
+		blobmsg_add_string(&slowlog.b, "expanded", expanded);
+		sqlite3_free(expanded);
+	}
+
+	slowlog_plan(stmt);
+
+	free(slowlog.entry[slowlog.next]);
+	slowlog.entry[slowlog.next] = blob_memdup(slowlog.b.head);
+	slowlog.next = (slowlog.next + 1) % SLOWLOG_SIZE;
+	slowlog.total++;
+}
+
+void
+slowlog_dump(struct blob_buf *b, int clear)
+{
+	unsigned int i;
+	void *c;
+
+	blobmsg_add_u32(b, "threshold", config.slow_query);
+	blobmsg_add_u64(b, "total", slowlog.total);
+
+	/* newest first */
+	c = blobmsg_open_array(b, "queries");
+	for (i = 0; i < SLOWLOG_SIZE; i++) {
+		unsigned int idx = (slowlog.next + SLOWLOG_SIZE - 1 - i) % SLOWLOG_SIZE;
+		struct blob_attr *entry = slowlog.entry[idx];
+
+		if (!entry)
+			continue;
+
+		blobmsg_add_field(b, BLOBMSG_TYPE_TABLE, NULL, blob_data(entry), blob_len(entry));
+		if (clear) {
+			free(entry);
+			slowlog.entry[idx] = NULL;
+		}
+	}
+	blobmsg_close_array(b, c);
+}
@@ -21,11 +21,21 @@
 int
 state_add(char *serial, struct blob_attr *b)
 {
-	char *sql = "INSERT INTO state (serial, state, timestamp) VALUES(@serial, @state, @timestamp)";
 	sqlite3_stmt *stmt;
+	char sql[128];
 	int rc;
 
-	db_prepare(rc, stmt, sql);
+	cache_bump(CACHE_TABLE_STATE, serial);
+
+	/* main deduplicates payloads, the hot tier keeps them inline */
+	if (!config.hot_path)
+		return blobstore_insert(db_state, "state", serial, b);
+
+	snprintf(sql, sizeof(sql),
+		 "INSERT INTO %s.state (serial, state, timestamp) VALUES(@serial, @state, @timestamp)",
+		 DB_INGEST);
+
+	db_prepare_on(db_state, rc, stmt, sql);
 
 	db_bind_text(stmt, "@serial", serial);
 	db_bind_blob(stmt, "@state", b);
@@ -34,12 +44,12 @@ state_add(char *serial, struct blob_attr *b)
 	return db_insert(stmt);
 }
 
-static int
+int
 state_list_cb(struct blob_buf *b, sqlite3_stmt *stmt)
 {
 	void *c = blobmsg_open_array(b, NULL);
 
-	blobmsg_add_u64(b, NULL, sqlite3_column_int(stmt, 0));
+	blobmsg_add_u64(b, NULL, sqlite3_column_int64(stmt, 0));
 	blobmsg_add_field(b, BLOBMSG_TYPE_TABLE, NULL,
 			  sqlite3_column_blob(stmt, 1),
 			  sqlite3_column_bytes(stmt, 1));
@@ -51,11 +61,11 @@ state_list_cb(struct blob_buf *b, sqlite3_stmt *stmt)
 int
 state_list(struct blob_buf *b, char *serial, int rows)
 {
-	char *sql = "SELECT timestamp, state FROM state WHERE serial = @serial ORDER by timestamp DESC LIMIT @rows;";
+	char *sql = "SELECT timestamp, state FROM state_all WHERE serial = @serial ORDER by timestamp DESC LIMIT @rows;";
 	sqlite3_stmt *stmt;
 	int rc;
 
-	db_prepare(rc, stmt, sql);
+	db_prepare_on(db_state, rc, stmt, sql);
 
 	db_bind_text(stmt, "@serial", serial);
 	db_bind_int64(stmt, "@rows", rows);
@@ -66,26 +76,18 @@ state_list(struct blob_buf *b, char *serial, int rows)
 int
 state_remove_serial(char *serial)
 {
-	char *sql = "DELETE FROM state WHERE serial = @serial";
-	sqlite3_stmt *stmt = NULL;
-	int rc;
+	char *sql = "DELETE FROM %s.state WHERE serial = @serial";
 
-	db_prepare(rc, stmt, sql);
+	cache_bump(CACHE_TABLE_STATE, serial);
 
-	db_bind_text(stmt, "@serial", serial);
-
-	return db_delete(stmt);
+	return db_tier_delete(db_state, sql, serial, 0);
 }
 
-int state_purge(int timestamp)
+int state_purge(int64_t timestamp)
 {
-	char *sql = "DELETE FROM state WHERE timestamp < @timestamp";
-	sqlite3_stmt *stmt = NULL;
-	int rc;
-
-	db_prepare(rc, stmt, sql);
+	char *sql = "DELETE FROM %s.state WHERE timestamp < @timestamp";
 
-	db_bind_int64(stmt, "@timestamp", timestamp);
+	cache_bump(CACHE_TABLE_STATE, NULL);
 
-	return db_delete(stmt);
+	return db_tier_delete(db_state, sql, NULL, timestamp);
 }
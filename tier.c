@@ -0,0 +1,327 @@
+/*
+ * Copyright (C) 2022 John Crispin <john@phrozen.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <limits.h>
+#include <time.h>
+
+#include <libubox/uloop.h>
+
+#include "db.h"
+
+/*
+ * With config.hot_path set, state/health/event rows are ingested into a
+ * RAM or tmpfs database attached as "hot" and moved over to the persistent
+ * main database once they are older than config.hot_age. The *_all views
+ * are what the list paths read from, they span both tiers.
+ */
+
+#define TABLE_HOT_STATE							\
+	"CREATE TABLE IF NOT EXISTS hot.state ("			\
+	"serial		VARCHAR(30) NOT NULL,"				\
+	"state		BLOB NOT NULL,"					\
+	"timestamp	BIGINT NOT NULL"				\
+	")"
+
+#define INDEX_HOT_STATE	"CREATE INDEX IF NOT EXISTS hot.state_index ON state(serial, timestamp)"
+
+#define TABLE_HOT_HEALTH						\
+	"CREATE TABLE IF NOT EXISTS hot.health ("			\
+	"serial		VARCHAR(30) NOT NULL,"				\
+	"health		BLOB NOT NULL,"					\
+	"timestamp	BIGINT NOT NULL"				\
+	")"
+
+#define INDEX_HOT_HEALTH	"CREATE INDEX IF NOT EXISTS hot.health_index ON health(serial, timestamp)"
+
+#define TABLE_HOT_EVENT							\
+	"CREATE TABLE IF NOT EXISTS hot.event ("			\
+	"type		VARCHAR(30) NOT NULL,"				\
+	"serial		VARCHAR(30),"					\
+	"client		VARCHAR(64),"					\
+	"event		TEXT,"						\
+	"timestamp	BIGINT NOT NULL,"				\
+	"last_seen	BIGINT,"					\
+	"count		INTEGER NOT NULL DEFAULT 1"			\
+	")"
+
+#define TABLE_HOT_EVENT_COUNTER					\
+	"CREATE TABLE IF NOT EXISTS hot.event_counter ("		\
+	"type		VARCHAR(30) NOT NULL,"				\
+	"serial		VARCHAR(30) NOT NULL,"				\
+	"bucket		BIGINT NOT NULL,"				\
+	"count		INTEGER NOT NULL,"				\
+	"PRIMARY KEY(type, serial, bucket)"				\
+	") WITHOUT ROWID"
+
+#define INDEX_HOT_EVENT_TYPE	"CREATE INDEX IF NOT EXISTS hot.event_type_index ON event(type)"
+#define INDEX_HOT_EVENT_SERIAL	"CREATE INDEX IF NOT EXISTS hot.event_serial_index ON event(serial, timestamp)"
+
+struct tier_family {
+	int idx;
+	char *hot[5];
+	char *view_hot;
+	char *view_main;
+	char *migrate[5];
+};
+
+static const struct tier_family tier_families[] = {
+	{
+		.idx = DB_STATE,
+		.hot = { TABLE_HOT_STATE, INDEX_HOT_STATE },
+		.view_hot = "CREATE TEMP VIEW state_all AS "
+			"SELECT serial, state, timestamp FROM hot.state UNION ALL "
+			"SELECT s.serial, IFNULL(b.data, s.state), s.timestamp FROM main.state s "
+			"LEFT JOIN main.blob_store b ON b.hash = s.hash",
+		.view_main = "CREATE TEMP VIEW state_all AS "
+			"SELECT s.serial, IFNULL(b.data, s.state) AS state, s.timestamp FROM main.state s "
+			"LEFT JOIN main.blob_store b ON b.hash = s.hash",
+		.migrate = {
+			/* payloads get deduplicated on their way into main */
+			"INSERT OR IGNORE INTO main.blob_store (hash, data, refs) "
+				"SELECT blob_hash(state), state, 0 FROM hot.state WHERE timestamp < @timestamp",
+			/*
+			 * distinct hot rowids on top of what main holds keep seq unique within the
+			 * batch, payloads whose hash is taken by different bytes stay inline
+			 */
+			"INSERT INTO main.state (serial, state, timestamp, hash, seq) "
+				"SELECT h.serial, CASE WHEN b.data = h.state THEN X'' ELSE h.state END, h.timestamp, "
+				"CASE WHEN b.data = h.state THEN b.hash END, "
+				"(SELECT IFNULL(MAX(m.seq), 0) FROM main.state m WHERE m.serial = h.serial AND m.timestamp = h.timestamp) + h.rowid "
+				"FROM hot.state h LEFT JOIN main.blob_store b ON b.hash = blob_hash(h.state) "
+				"WHERE h.timestamp < @timestamp ORDER BY h.rowid",
+			"DELETE FROM hot.state WHERE timestamp < @timestamp",
+		},
+	}, {
+		.idx = DB_HEALTH,
+		.hot = { TABLE_HOT_HEALTH, INDEX_HOT_HEALTH },
+		.view_hot = "CREATE TEMP VIEW health_all AS "
+			"SELECT serial, health, timestamp FROM hot.health UNION ALL "
+			"SELECT h.serial, IFNULL(b.data, h.health), h.timestamp FROM main.health h "
+			"LEFT JOIN main.blob_store b ON b.hash = h.hash",
+		.view_main = "CREATE TEMP VIEW health_all AS "
+			"SELECT h.serial, IFNULL(b.data, h.health) AS health, h.timestamp FROM main.health h "
+			"LEFT JOIN main.blob_store b ON b.hash = h.hash",
+		.migrate = {
+			"INSERT OR IGNORE INTO main.blob_store (hash, data, refs) "
+				"SELECT blob_hash(health), health, 0 FROM hot.health WHERE timestamp < @timestamp",
+			"INSERT INTO main.health (serial, health, timestamp, hash, seq) "
+				"SELECT h.serial, CASE WHEN b.data = h.health THEN X'' ELSE h.health END, h.timestamp, "
+				"CASE WHEN b.data = h.health THEN b.hash END, "
+				"(SELECT IFNULL(MAX(m.seq), 0) FROM main.health m WHERE m.serial = h.serial AND m.timestamp = h.timestamp) + h.rowid "
+				"FROM hot.health h LEFT JOIN main.blob_store b ON b.hash = blob_hash(h.health) "
+				"WHERE h.timestamp < @timestamp ORDER BY h.rowid",
+			"DELETE FROM hot.health WHERE timestamp < @timestamp",
+		},
+	}, {
+		.idx = DB_EVENT,
+		.hot = { TABLE_HOT_EVENT, INDEX_HOT_EVENT_TYPE, INDEX_HOT_EVENT_SERIAL, TABLE_HOT_EVENT_COUNTER },
+		.view_hot = "CREATE TEMP VIEW event_all AS "
+			"SELECT 1 AS tier, rowid AS id, type, serial, client, event, timestamp, last_seen, count FROM hot.event UNION ALL "
+			"SELECT 0 AS tier, rowid AS id, type, serial, client, event, timestamp, last_seen, count FROM main.event",
+		.view_main = "CREATE TEMP VIEW event_all AS "
+			"SELECT 0 AS tier, rowid AS id, type, serial, client, event, timestamp, last_seen, count FROM main.event",
+		.migrate = {
+			"INSERT INTO main.event (type, serial, client, event, timestamp, last_seen, count) "
+				"SELECT type, serial, client, event, timestamp, last_seen, count FROM hot.event WHERE timestamp < @timestamp ORDER BY rowid",
+			"DELETE FROM hot.event WHERE timestamp < @timestamp",
+			/* buckets only move once they are closed */
+			"INSERT INTO main.event_counter (type, serial, bucket, count) "
+				"SELECT type, serial, bucket, count FROM hot.event_counter "
+				"WHERE bucket + " db_str(EVENT_COUNT_BUCKET) " <= @timestamp "
+				"ON CONFLICT(type, serial, bucket) DO UPDATE SET count = count + excluded.count",
+			"DELETE FROM hot.event_counter WHERE bucket + " db_str(EVENT_COUNT_BUCKET) " <= @timestamp",
+		},
+	},
+};
+
+static void tier_timeout_cb(struct uloop_timeout *t);
+
+static struct uloop_timeout tier_timeout = {
+	.cb = tier_timeout_cb,
+};
+
+static int
+tier_exec(sqlite3 *h, char *sql, int64_t timestamp)
+{
+	sqlite3_stmt *stmt;
+	int rc;
+
+	db_prepare_on(h, rc, stmt, sql);
+
+	db_bind_int64(stmt, "@timestamp", timestamp);
+
+	return db_insert(stmt);
+}
+
+static int
+tier_migrate(const struct tier_family *f, int64_t timestamp)
+{
+	sqlite3 *h = db_handle[f->idx];
+	sqlite3_int64 rowid = 0;
+	sqlite3_stmt *stmt;
+	int fts = config.fts && f->idx == DB_EVENT;
+	int rc, i;
+
+	/* the fts index only covers main, pick up the rowids the events land on */
+	if (fts) {
+		db_prepare_on(h, rc, stmt, "SELECT COALESCE(MAX(rowid), 0) FROM main.event");
+		if (sqlite3_step(stmt) == SQLITE_ROW)
+			rowid = sqlite3_column_int64(stmt, 0);
+		sqlite3_finalize(stmt);
+	}
+
+	for (i = 0; f->migrate[i]; i++) {
+		rc = tier_exec(h, f->migrate[i], timestamp);
+		if (rc)
+			return rc;
+	}
+
+	if (!fts)
+		return 0;
+
+	db_prepare_on(h, rc, stmt, "INSERT INTO event_fts (rowid, event) SELECT rowid, event FROM main.event WHERE rowid > @rowid AND typeof(event) = 'text'");
+
+	db_bind_int64(stmt, "@rowid", rowid);
+
+	return db_insert(stmt);
+}
+
+void
+tier_flush(int all)
+{
+	int64_t timestamp = all ? INT64_MAX : time(NULL) - config.hot_age;
+	int i, rc;
+
+	if (!config.hot_path)
+		return;
+
+	/* one large transaction per family, the persistent file sees few sequential writes */
+	for (i = 0; i < ARRAY_SIZE(tier_families); i++) {
+		const struct tier_family *f = &tier_families[i];
+		sqlite3 *h = db_handle[f->idx];
+
+		rc = db_exec_on(h, "BEGIN TRANSACTION;");
+		if (rc)
+			continue;
+
+		rc = tier_migrate(f, timestamp);
+		if (rc) {
+			ulog(LOG_ERR, "failed to move %s rows out of the hot tier\n", db_names[f->idx]);
+			db_exec_on(h, "ROLLBACK;");
+			continue;
+		}
+
+		db_exec_on(h, "COMMIT;");
+	}
+}
+
+static void
+tier_timeout_cb(struct uloop_timeout *t)
+{
+	tier_flush(0);
+	uloop_timeout_set(t, config.hot_interval * 1000);
+}
+
+static int
+tier_attach(int idx)
+{
+	sqlite3 *h = db_handle[idx];
+	char path[PATH_MAX];
+	sqlite3_stmt *stmt;
+	int rc;
+
+	/* families sharing a connection share its hot database as well */
+	if (sqlite3_db_filename(h, "hot"))
+		return 0;
+
+	db_prepare_on(h, rc, stmt, "ATTACH DATABASE @path AS hot");
+
+	db_bind_text(stmt, "@path", db_family_path(path, sizeof(path), config.hot_path, idx));
+
+	return db_insert(stmt);
+}
+
+int
+tier_start(void)
+{
+	int i, j, rc;
+
+	for (i = 0; i < ARRAY_SIZE(tier_families); i++) {
+		const struct tier_family *f = &tier_families[i];
+		sqlite3 *h = db_handle[f->idx];
+
+		if (!config.hot_path) {
+			rc = db_exec_on(h, f->view_main);
+			if (rc)
+				return rc;
+			continue;
+		}
+
+		rc = tier_attach(f->idx);
+		for (j = 0; !rc && f->hot[j]; j++)
+			rc = db_exec_on(h, f->hot[j]);
+		if (!rc)
+			rc = db_exec_on(h, f->view_hot);
+		if (rc)
+			return rc;
+	}
+
+	if (config.hot_path)
+		uloop_timeout_set(&tier_timeout, config.hot_interval * 1000);
+
+	return 0;
+}
+
+void
+tier_stop(void)
+{
+	uloop_timeout_cancel(&tier_timeout);
+	tier_flush(1);
+}
+
+int
+__db_tier_delete(sqlite3 *h, char *fmt, char *serial, int64_t timestamp, const char *func, const int line)
+{
+	static char *tiers[] = { "main", "hot", NULL };
+	char **tier;
+
+	for (tier = tiers; *tier; tier++) {
+		sqlite3_stmt *stmt;
+		char sql[256];
+		int rc;
+
+		if (tier != tiers && !config.hot_path)
+			break;
+
+		snprintf(sql, sizeof(sql), fmt, *tier);
+
+		rc = sqlite3_prepare_v2(h, sql, -1, &stmt, 0);
+		if (rc != SQLITE_OK) {
+			ulog(LOG_ERR, "SQL error (%s:%d): (%d) - %s\n", func, line, rc, sqlite3_errmsg(h));
+			return -1;
+		}
+
+		if (serial)
+			rc = __db_bind_text(stmt, "@serial", serial, func, line);
+		else
+			rc = __db_bind_int64(stmt, "@timestamp", timestamp, func, line);
+
+		if (rc || __db_simple(stmt, func, line))
+			return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,170 @@
+/*
+ * Copyright (C) 2022 John Crispin <john@phrozen.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "db.h"
+
+/*
+ * A device's timeline is built from one cursor per table and tier. Each
+ * cursor is a range scan over the (serial, timestamp) index returning its
+ * rows newest first, the cursors are then merged by timestamp. Rows are
+ * emitted in the format of the matching *_list method, prefixed with the
+ * name of the table they came from.
+ */
+
+#define TIMELINE_TIERS	2
+
+struct timeline_source {
+	int idx;
+	char *name;
+	char *sql[TIMELINE_TIERS];
+	int (*cb)(struct blob_buf *b, sqlite3_stmt *stmt);
+};
+
+/* one query per tier, main resolves deduplicated payloads, events report their tier last */
+static const struct timeline_source timeline_sources[] = {
+	{
+		.idx = DB_STATE,
+		.name = "state",
+		.sql = {
+			"SELECT s.timestamp, IFNULL(b.data, s.state) FROM main.state s "
+				"LEFT JOIN main.blob_store b ON b.hash = s.hash "
+				"WHERE s.serial = @serial AND s.timestamp >= @from AND s.timestamp <= @to "
+				"ORDER BY s.timestamp DESC LIMIT @rows",
+			"SELECT timestamp, state FROM hot.state "
+				"WHERE serial = @serial AND timestamp >= @from AND timestamp <= @to "
+				"ORDER BY timestamp DESC LIMIT @rows",
+		},
+		.cb = state_list_cb,
+	}, {
+		.idx = DB_HEALTH,
+		.name = "health",
+		.sql = {
+			"SELECT h.timestamp, IFNULL(b.data, h.health) FROM main.health h "
+				"LEFT JOIN main.blob_store b ON b.hash = h.hash "
+				"WHERE h.serial = @serial AND h.timestamp >= @from AND h.timestamp <= @to "
+				"ORDER BY h.timestamp DESC LIMIT @rows",
+			"SELECT timestamp, health FROM hot.health "
+				"WHERE serial = @serial AND timestamp >= @from AND timestamp <= @to "
+				"ORDER BY timestamp DESC LIMIT @rows",
+		},
+		.cb = health_list_cb,
+	}, {
+		.idx = DB_EVENT,
+		.name = "event",
+		.sql = {
+			"SELECT timestamp, type, event, serial, client, COALESCE(last_seen, timestamp), count, rowid, 0 "
+				"FROM main.event "
+				"WHERE serial = @serial AND timestamp >= @from AND timestamp <= @to "
+				"ORDER BY timestamp DESC LIMIT @rows",
+			"SELECT timestamp, type, event, serial, client, COALESCE(last_seen, timestamp), count, rowid, 1 "
+				"FROM hot.event "
+				"WHERE serial = @serial AND timestamp >= @from AND timestamp <= @to "
+				"ORDER BY timestamp DESC LIMIT @rows",
+		},
+		.cb = event_list_cb,
+	},
+};
+
+#define TIMELINE_MAX	(ARRAY_SIZE(timeline_sources) * TIMELINE_TIERS)
+
+struct timeline_cursor {
+	const struct timeline_source *source;
+	sqlite3_stmt *stmt;
+	int row;
+};
+
+static int
+timeline_open(struct timeline_cursor *c, const struct timeline_source *source, int tier,
+	      char *serial, int64_t from, int64_t to, int rows)
+{
+	sqlite3 *h = db_handle[source->idx];
+	int rc;
+
+	c->source = source;
+	db_prepare_on(h, rc, c->stmt, source->sql[tier]);
+
+	/* a failing bind finalizes the statement, device_timeline() must not do that again */
+	if (__db_bind_text(c->stmt, "@serial", serial, __func__, __LINE__) ||
+	    __db_bind_int64(c->stmt, "@from", from, __func__, __LINE__) ||
+	    __db_bind_int64(c->stmt, "@to", to, __func__, __LINE__) ||
+	    __db_bind_int64(c->stmt, "@rows", rows, __func__, __LINE__)) {
+		c->stmt = NULL;
+		return -1;
+	}
+
+	c->row = sqlite3_step(c->stmt) == SQLITE_ROW;
+
+	return 0;
+}
+
+static struct timeline_cursor *
+timeline_next(struct timeline_cursor *cursor, int count)
+{
+	struct timeline_cursor *next = NULL;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (!cursor[i].row)
+			continue;
+		if (!next || sqlite3_column_int64(cursor[i].stmt, 0) > sqlite3_column_int64(next->stmt, 0))
+			next = &cursor[i];
+	}
+
+	return next;
+}
+
+int
+device_timeline(struct blob_buf *b, char *serial, int64_t from, int64_t to, int rows, int offset)
+{
+	struct timeline_cursor cursor[TIMELINE_MAX] = { 0 };
+	struct timeline_cursor *next;
+	int count = 0, rc = 0;
+	unsigned int i, j;
+	void *c, *d;
+
+	/* no cursor can contribute more than a full page past the offset */
+	for (i = 0; i < ARRAY_SIZE(timeline_sources) && !rc; i++)
+		for (j = 0; j < TIMELINE_TIERS && !rc; j++) {
+			if (j && !config.hot_path)
+				break;
+			rc = timeline_open(&cursor[count++], &timeline_sources[i], j,
+					   serial, from, to, rows + offset);
+		}
+
+	if (!rc) {
+		blob_buf_init(b, 0);
+
+		c = blobmsg_open_array(b, "rows");
+		while (rows && (next = timeline_next(cursor, count))) {
+			if (offset) {
+				offset--;
+			} else {
+				d = blobmsg_open_array(b, NULL);
+				blobmsg_add_string(b, NULL, next->source->name);
+				next->source->cb(b, next->stmt);
+				blobmsg_close_array(b, d);
+				rows--;
+			}
+			next->row = sqlite3_step(next->stmt) == SQLITE_ROW;
+		}
+		blobmsg_close_array(b, c);
+	}
+
+	for (i = 0; i < count; i++)
+		sqlite3_finalize(cursor[i].stmt);
+
+	return rc;
+}
@@ -0,0 +1,256 @@
+/*
+ * Copyright (C) 2022 John Crispin <john@phrozen.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "db.h"
+
+/* Space-Saving summaries, each stream keeps at most TOPK_SIZE counters per bucket */
+#define TOPK_SIZE	32
+#define TOPK_KEY_LEN	64
+
+static const char * const topk_names[__TOPK_MAX] = {
+	[TOPK_STATE] = "state",
+	[TOPK_HEALTH] = "health",
+	[TOPK_EVENT] = "event",
+	[TOPK_EVENT_TYPE] = "event_type",
+};
+
+struct topk_counter {
+	char key[TOPK_KEY_LEN];
+	uint64_t count;
+	uint64_t error;
+};
+
+struct topk_summary {
+	struct topk_counter counter[TOPK_SIZE];
+	int used;
+	uint64_t total;
+};
+
+/*
+ * The window is a ring of TOPK_BUCKETS summaries, each covering one slot
+ * of topk_window / TOPK_BUCKETS seconds. Hits only go into the newest
+ * bucket, a reply merges every bucket still inside the window, so the
+ * window slides by one slot at a time instead of resetting as a whole.
+ */
+#define TOPK_BUCKETS	6
+
+struct topk_bucket {
+	struct topk_summary summary[__TOPK_MAX];
+	int64_t slot;
+};
+
+static struct {
+	struct topk_bucket bucket[TOPK_BUCKETS];
+	int slot_len;
+} topk;
+
+static time_t
+topk_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec;
+}
+
+static int64_t
+topk_slot(void)
+{
+	int slot_len = config.topk_window / TOPK_BUCKETS;
+
+	if (slot_len < 1)
+		slot_len = 1;
+
+	/* a reload changing the window makes the old slots meaningless */
+	if (slot_len != topk.slot_len) {
+		memset(topk.bucket, 0, sizeof(topk.bucket));
+		topk.slot_len = slot_len;
+	}
+
+	return topk_now() / slot_len + 1;
+}
+
+static struct topk_summary *
+topk_current(int stream)
+{
+	int64_t slot = topk_slot();
+	struct topk_bucket *bucket = &topk.bucket[slot % TOPK_BUCKETS];
+
+	if (bucket->slot != slot) {
+		memset(bucket, 0, sizeof(*bucket));
+		bucket->slot = slot;
+	}
+
+	return &bucket->summary[stream];
+}
+
+void
+topk_add(int stream, char *key)
+{
+	struct topk_summary *s;
+	struct topk_counter *min = NULL;
+	int i;
+
+	if (!config.topk_window)
+		return;
+
+	s = topk_current(stream);
+	s->total++;
+
+	if (!key)
+		key = "";
+
+	for (i = 0; i < s->used; i++) {
+		struct topk_counter *c = &s->counter[i];
+
+		if (!strncmp(c->key, key, TOPK_KEY_LEN - 1)) {
+			c->count++;
+			return;
+		}
+		if (!min || c->count < min->count)
+			min = c;
+	}
+
+	if (s->used < TOPK_SIZE) {
+		min = &s->counter[s->used++];
+		min->count = 0;
+	}
+
+	/* the evicted counter's hits become the newcomer's error bound */
+	min->error = min->count;
+	min->count++;
+	snprintf(min->key, sizeof(min->key), "%s", key);
+}
+
+static struct topk_counter *
+topk_find(struct topk_counter *counter, int used, const char *key)
+{
+	int i;
+
+	for (i = 0; i < used; i++)
+		if (!strcmp(counter[i].key, key))
+			return &counter[i];
+
+	return NULL;
+}
+
+/* a key missing from a full summary may have had up to its smallest count there */
+static uint64_t
+topk_floor(struct topk_summary *s)
+{
+	uint64_t floor;
+	int i;
+
+	if (s->used < TOPK_SIZE)
+		return 0;
+
+	floor = s->counter[0].count;
+	for (i = 1; i < s->used; i++)
+		if (s->counter[i].count < floor)
+			floor = s->counter[i].count;
+
+	return floor;
+}
+
+static int
+topk_cmp(const void *a, const void *b)
+{
+	const struct topk_counter *c1 = a, *c2 = b;
+
+	if (c1->count == c2->count)
+		return 0;
+
+	return c1->count < c2->count ? 1 : -1;
+}
+
+/* Space-Saving summaries merge by adding up the counters of every bucket inside the window */
+static void
+topk_dump_stream(struct blob_buf *b, int stream, int64_t slot, int limit)
+{
+	static struct topk_counter merged[TOPK_BUCKETS * TOPK_SIZE];
+	struct topk_summary *live[TOPK_BUCKETS];
+	struct topk_counter *counter;
+	uint64_t total = 0;
+	int n = 0, used = 0;
+	void *c, *d, *e;
+	int i, j;
+
+	for (i = 0; i < TOPK_BUCKETS; i++)
+		if (topk.bucket[i].slot > slot - TOPK_BUCKETS)
+			live[n++] = &topk.bucket[i].summary[stream];
+
+	for (i = 0; i < n; i++) {
+		total += live[i]->total;
+
+		for (j = 0; j < live[i]->used; j++) {
+			if (topk_find(merged, used, live[i]->counter[j].key))
+				continue;
+
+			merged[used] = live[i]->counter[j];
+			merged[used].count = merged[used].error = 0;
+			used++;
+		}
+	}
+
+	for (j = 0; j < used; j++) {
+		for (i = 0; i < n; i++) {
+			counter = topk_find(live[i]->counter, live[i]->used, merged[j].key);
+			if (counter) {
+				merged[j].count += counter->count;
+				merged[j].error += counter->error;
+			} else {
+				merged[j].count += topk_floor(live[i]);
+				merged[j].error += topk_floor(live[i]);
+			}
+		}
+	}
+
+	qsort(merged, used, sizeof(*merged), topk_cmp);
+
+	c = blobmsg_open_table(b, topk_names[stream]);
+	blobmsg_add_u64(b, "total", total);
+	d = blobmsg_open_array(b, "top");
+	for (i = 0; i < used && i < limit; i++) {
+		e = blobmsg_open_table(b, NULL);
+		blobmsg_add_string(b, "key", merged[i].key);
+		blobmsg_add_u64(b, "count", merged[i].count);
+		blobmsg_add_u64(b, "error", merged[i].error);
+		blobmsg_close_table(b, e);
+	}
+	blobmsg_close_array(b, d);
+	blobmsg_close_table(b, c);
+}
+
+void
+topk_dump(struct blob_buf *b, int limit)
+{
+	int64_t slot;
+	int i;
+
+	if (limit <= 0 || limit > TOPK_SIZE)
+		limit = TOPK_SIZE;
+
+	slot = topk_slot();
+
+	blobmsg_add_u32(b, "window", config.topk_window);
+	blobmsg_add_u32(b, "slot", topk.slot_len);
+	for (i = 0; i < __TOPK_MAX; i++)
+		topk_dump_stream(b, i, slot, limit);
+}
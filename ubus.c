@@ -18,9 +18,207 @@
 
 #include "db.h"
 
+/* filter objects nobody subscribed to get removed again after this long */
+#define NOTIFY_IDLE_TIMEOUT	30
+
+struct notify_filter {
+	struct list_head list;
+	struct ubus_object obj;
+	struct uloop_timeout timeout;
+
+	char *serial;
+	char *type;
+	char *compatible;
+	char name[32];
+};
+
+/* each method builds its reply in a buffer of its own, which is kept around for the next call */
+enum {
+	REPLY_DEVICE_LIST,
+	REPLY_DEVICE_TIMELINE,
+	REPLY_STATE_LIST,
+	REPLY_HEALTH_LIST,
+	REPLY_EVENT_LIST,
+	REPLY_EVENT_SEARCH,
+	REPLY_EVENT_COUNT,
+	REPLY_SUBSCRIBE,
+	REPLY_STATS,
+	REPLY_TOP,
+	REPLY_SLOW_QUERIES,
+	REPLY_RATE_LIMITED,
+	__REPLY_MAX,
+};
+
+/* buffers that grew past this after an unusually large reply are given back */
+#define REPLY_MAX_RETAIN	(64 * 1024)
+
 static struct ubus_auto_conn conn;
+static struct blob_buf reply[__REPLY_MAX];
 struct blob_buf b = {};
 
+static struct ubus_object urender_object;
+static struct ubus_object_type notify_object_type = {
+	.name = "collect.notify",
+};
+static LIST_HEAD(notify_filters);
+static unsigned int notify_compatible;
+static unsigned int notify_id;
+
+static void
+ubus_reply(struct ubus_context *ctx, struct ubus_request_data *req, struct blob_buf *buf)
+{
+	ubus_send_reply(ctx, req, buf->head);
+
+	if (buf->buflen > REPLY_MAX_RETAIN)
+		blob_buf_free(buf);
+}
+
+/* answers from the reply cache, returns 0 if the request has to be run */
+static int
+ubus_reply_cached(struct ubus_context *ctx, struct ubus_request_data *req, int method, struct blob_attr *msg)
+{
+	struct blob_attr *cached = cache_get(method, msg);
+
+	if (!cached)
+		return 0;
+
+	ubus_send_reply(ctx, req, cached);
+
+	return 1;
+}
+
+/*
+ * over-limit adds fail with UBUS_STATUS_UNKNOWN_ERROR, which no other add
+ * path returns, and a reply carrying retry_after, the milliseconds until
+ * the serial may send again
+ */
+static int
+ubus_rate_limited(struct ubus_context *ctx, struct ubus_request_data *req, char *serial, int method)
+{
+	int wait = ratelimit_check(serial, method);
+
+	if (!wait)
+		return 0;
+
+	blob_buf_init(&reply[REPLY_RATE_LIMITED], 0);
+	blobmsg_add_u32(&reply[REPLY_RATE_LIMITED], "retry_after", wait);
+	ubus_reply(ctx, req, &reply[REPLY_RATE_LIMITED]);
+
+	return UBUS_STATUS_UNKNOWN_ERROR;
+}
+
+static int
+notify_strcmp(const char *s1, const char *s2)
+{
+	if (!s1 || !s2)
+		return !!s1 - !!s2;
+
+	return strcmp(s1, s2);
+}
+
+static void
+notify_filter_timeout_cb(struct uloop_timeout *t)
+{
+	struct notify_filter *filter = container_of(t, struct notify_filter, timeout);
+
+	if (filter->obj.has_subscribers)
+		return;
+
+	ubus_remove_object(&conn.ctx, &filter->obj);
+	list_del(&filter->list);
+	if (filter->compatible)
+		notify_compatible--;
+	free(filter);
+}
+
+static void
+notify_filter_subscribe_cb(struct ubus_context *ctx, struct ubus_object *obj)
+{
+	struct notify_filter *filter = container_of(obj, struct notify_filter, obj);
+
+	/* the object can not be removed from within its own callback */
+	if (!obj->has_subscribers)
+		uloop_timeout_set(&filter->timeout, 0);
+}
+
+static struct notify_filter *
+notify_filter_get(struct ubus_context *ctx, char *serial, char *type, char *compatible)
+{
+	struct notify_filter *filter;
+	char *_serial, *_type, *_compatible;
+
+	/* identical filters share one object, so fan-out happens in ubusd */
+	list_for_each_entry(filter, &notify_filters, list)
+		if (!notify_strcmp(filter->serial, serial) &&
+		    !notify_strcmp(filter->type, type) &&
+		    !notify_strcmp(filter->compatible, compatible)) {
+			/* give the new caller the full window to subscribe */
+			if (!filter->obj.has_subscribers)
+				uloop_timeout_set(&filter->timeout, NOTIFY_IDLE_TIMEOUT * 1000);
+			return filter;
+		}
+
+	filter = calloc_a(sizeof(*filter),
+			  &_serial, serial ? strlen(serial) + 1 : 0,
+			  &_type, type ? strlen(type) + 1 : 0,
+			  &_compatible, compatible ? strlen(compatible) + 1 : 0);
+	if (!filter)
+		return NULL;
+
+	if (serial)
+		filter->serial = strcpy(_serial, serial);
+	if (type)
+		filter->type = strcpy(_type, type);
+	if (compatible)
+		filter->compatible = strcpy(_compatible, compatible);
+
+	snprintf(filter->name, sizeof(filter->name), "collect.notify.%u", ++notify_id);
+	filter->obj.name = filter->name;
+	filter->obj.type = &notify_object_type;
+	filter->obj.subscribe_cb = notify_filter_subscribe_cb;
+
+	if (ubus_add_object(ctx, &filter->obj)) {
+		free(filter);
+		return NULL;
+	}
+
+	list_add_tail(&filter->list, &notify_filters);
+	if (filter->compatible)
+		notify_compatible++;
+
+	filter->timeout.cb = notify_filter_timeout_cb;
+	uloop_timeout_set(&filter->timeout, NOTIFY_IDLE_TIMEOUT * 1000);
+
+	return filter;
+}
+
+static void
+notify_send(struct ubus_context *ctx, const char *method, char *serial, char *type,
+	    struct blob_attr *msg)
+{
+	struct notify_filter *filter;
+	char compatible[64] = "";
+
+	if (urender_object.has_subscribers)
+		ubus_notify(ctx, &urender_object, method, msg, -1);
+
+	if (notify_compatible && serial)
+		device_compatible(serial, compatible, sizeof(compatible));
+
+	list_for_each_entry(filter, &notify_filters, list) {
+		if (!filter->obj.has_subscribers)
+			continue;
+		if (filter->serial && notify_strcmp(filter->serial, serial))
+			continue;
+		if (filter->type && notify_strcmp(filter->type, type))
+			continue;
+		if (filter->compatible && strcmp(filter->compatible, compatible))
+			continue;
+
+		ubus_notify(ctx, &filter->obj, method, msg, -1);
+	}
+}
+
 enum device_add_attr {
 	DEVICE_ADD_SERIAL,
 	DEVICE_ADD_COMPAT,
@@ -78,15 +276,43 @@ ubus_device_remove(struct ubus_context *ctx, struct ubus_object *obj,
 	return UBUS_STATUS_OK;
 }
 
+enum device_list_attr {
+	DEVICE_LIST_STALE,
+	DEVICE_LIST_SINCE,
+	DEVICE_LIST_MAX,
+};
+
+static const struct blobmsg_policy device_list_policy[DEVICE_LIST_MAX] = {
+	[DEVICE_LIST_STALE]	= { "stale", BLOBMSG_TYPE_INT64 },
+	[DEVICE_LIST_SINCE]	= { "since", BLOBMSG_TYPE_INT64 },
+};
+
 static int
 ubus_device_list(struct ubus_context *ctx, struct ubus_object *obj,
 		 struct ubus_request_data *req, const char *method,
 		 struct blob_attr *msg)
 {
-	if (device_list(&b))
+	struct blob_attr *tb[DEVICE_LIST_MAX];
+	int64_t stale = 0, since = 0;
+
+	blobmsg_parse(device_list_policy, DEVICE_LIST_MAX, tb, blob_data(msg), blob_len(msg));
+
+	/* only list devices that have not been heard of since this timestamp */
+	if (tb[DEVICE_LIST_STALE])
+		stale = blobmsg_get_u64(tb[DEVICE_LIST_STALE]);
+
+	/* only return what changed after this seq, including removals */
+	if (tb[DEVICE_LIST_SINCE])
+		since = blobmsg_get_u64(tb[DEVICE_LIST_SINCE]);
+
+	if (ubus_reply_cached(ctx, req, CACHE_DEVICE_LIST, msg))
+		return UBUS_STATUS_OK;
+
+	if (device_list(&reply[REPLY_DEVICE_LIST], stale, since))
 		return UBUS_STATUS_INVALID_ARGUMENT;
 
-	ubus_send_reply(ctx, req, b.head);
+	cache_put(CACHE_DEVICE_LIST, msg, NULL, reply[REPLY_DEVICE_LIST].head);
+	ubus_reply(ctx, req, &reply[REPLY_DEVICE_LIST]);
 
 	return UBUS_STATUS_OK;
 }
@@ -108,16 +334,26 @@ ubus_state_add(struct ubus_context *ctx, struct ubus_object *obj,
 	       struct blob_attr *msg)
 {
 	struct blob_attr *tb[STATE_ADD_MAX];
+	int rc;
 
 	blobmsg_parse(state_add_policy, STATE_ADD_MAX, tb, blob_data(msg), blob_len(msg));
 
 	if (!tb[STATE_ADD_SERIAL] || !tb[STATE_ADD_BLOB])
 		return UBUS_STATUS_INVALID_ARGUMENT;
 
+	topk_add(TOPK_STATE, blobmsg_get_string(tb[STATE_ADD_SERIAL]));
+
+	rc = ubus_rate_limited(ctx, req, blobmsg_get_string(tb[STATE_ADD_SERIAL]), RATELIMIT_STATE);
+	if (rc)
+		return rc;
+
 	if (state_add(blobmsg_get_string(tb[DEVICE_ADD_SERIAL]),
 		      tb[STATE_ADD_BLOB]))
 		return UBUS_STATUS_INVALID_ARGUMENT;
 
+	device_seen(blobmsg_get_string(tb[STATE_ADD_SERIAL]));
+	notify_send(ctx, "state", blobmsg_get_string(tb[STATE_ADD_SERIAL]), NULL, msg);
+
 	return UBUS_STATUS_OK;
 }
 
@@ -144,11 +380,15 @@ ubus_state_list(struct ubus_context *ctx, struct ubus_object *obj,
 	if (!tb[STATE_LIST_SERIAL] || !tb[STATE_LIST_ROWS])
 		return UBUS_STATUS_INVALID_ARGUMENT;
 
-	if (state_list(&b, blobmsg_get_string(tb[STATE_LIST_SERIAL]),
+	if (ubus_reply_cached(ctx, req, CACHE_STATE_LIST, msg))
+		return UBUS_STATUS_OK;
+
+	if (state_list(&reply[REPLY_STATE_LIST], blobmsg_get_string(tb[STATE_LIST_SERIAL]),
 		       blobmsg_get_u32(tb[STATE_LIST_ROWS])))
 		return UBUS_STATUS_INVALID_ARGUMENT;
 
-	ubus_send_reply(ctx, req, b.head);
+	cache_put(CACHE_STATE_LIST, msg, blobmsg_get_string(tb[STATE_LIST_SERIAL]), reply[REPLY_STATE_LIST].head);
+	ubus_reply(ctx, req, &reply[REPLY_STATE_LIST]);
 
 	return UBUS_STATUS_OK;
 }
@@ -170,16 +410,26 @@ ubus_health_add(struct ubus_context *ctx, struct ubus_object *obj,
 	       struct blob_attr *msg)
 {
 	struct blob_attr *tb[HEALTH_ADD_MAX];
+	int rc;
 
 	blobmsg_parse(health_add_policy, HEALTH_ADD_MAX, tb, blob_data(msg), blob_len(msg));
 
 	if (!tb[HEALTH_ADD_SERIAL] || !tb[HEALTH_ADD_BLOB])
 		return UBUS_STATUS_INVALID_ARGUMENT;
 
+	topk_add(TOPK_HEALTH, blobmsg_get_string(tb[HEALTH_ADD_SERIAL]));
+
+	rc = ubus_rate_limited(ctx, req, blobmsg_get_string(tb[HEALTH_ADD_SERIAL]), RATELIMIT_HEALTH);
+	if (rc)
+		return rc;
+
 	if (health_add(blobmsg_get_string(tb[DEVICE_ADD_SERIAL]),
 		      tb[HEALTH_ADD_BLOB]))
 		return UBUS_STATUS_INVALID_ARGUMENT;
 
+	device_seen(blobmsg_get_string(tb[HEALTH_ADD_SERIAL]));
+	notify_send(ctx, "health", blobmsg_get_string(tb[HEALTH_ADD_SERIAL]), NULL, msg);
+
 	return UBUS_STATUS_OK;
 }
 
@@ -206,11 +456,15 @@ ubus_health_list(struct ubus_context *ctx, struct ubus_object *obj,
 	if (!tb[HEALTH_LIST_SERIAL] || !tb[HEALTH_LIST_ROWS])
 		return UBUS_STATUS_INVALID_ARGUMENT;
 
-	if (health_list(&b, blobmsg_get_string(tb[HEALTH_LIST_SERIAL]),
+	if (ubus_reply_cached(ctx, req, CACHE_HEALTH_LIST, msg))
+		return UBUS_STATUS_OK;
+
+	if (health_list(&reply[REPLY_HEALTH_LIST], blobmsg_get_string(tb[HEALTH_LIST_SERIAL]),
 		       blobmsg_get_u32(tb[HEALTH_LIST_ROWS])))
 		return UBUS_STATUS_INVALID_ARGUMENT;
 
-	ubus_send_reply(ctx, req, b.head);
+	cache_put(CACHE_HEALTH_LIST, msg, blobmsg_get_string(tb[HEALTH_LIST_SERIAL]), reply[REPLY_HEALTH_LIST].head);
+	ubus_reply(ctx, req, &reply[REPLY_HEALTH_LIST]);
 
 	return UBUS_STATUS_OK;
 }
@@ -227,7 +481,7 @@ static const struct blobmsg_policy event_add_policy[EVENT_ADD_MAX] = {
 	[EVENT_ADD_TYPE]	= { "type", BLOBMSG_TYPE_STRING },
 	[EVENT_ADD_SERIAL]	= { "serial", BLOBMSG_TYPE_STRING },
 	[EVENT_ADD_CLIENT]	= { "client", BLOBMSG_TYPE_STRING },
-	[EVENT_ADD_EVENT]	= { "event", BLOBMSG_TYPE_STRING },
+	[EVENT_ADD_EVENT]	= { "event", BLOBMSG_TYPE_UNSPEC },
 };
 
 static int
@@ -237,23 +491,39 @@ ubus_event_add(struct ubus_context *ctx, struct ubus_object *obj,
 {
 	struct blob_attr *tb[EVENT_ADD_MAX];
 	char *serial = NULL, *client = NULL;
+	int rc;
 
 	blobmsg_parse(event_add_policy, EVENT_ADD_MAX, tb, blob_data(msg), blob_len(msg));
 
 	if (!tb[EVENT_ADD_TYPE] || !tb[EVENT_ADD_EVENT])
 		return UBUS_STATUS_INVALID_ARGUMENT;
 
+	/* the payload is either a string or a table that gets stored as is */
+	if (blobmsg_type(tb[EVENT_ADD_EVENT]) != BLOBMSG_TYPE_STRING &&
+	    blobmsg_type(tb[EVENT_ADD_EVENT]) != BLOBMSG_TYPE_TABLE)
+		return UBUS_STATUS_INVALID_ARGUMENT;
+
 	if (tb[EVENT_ADD_SERIAL])
 		serial = blobmsg_get_string(tb[EVENT_ADD_SERIAL]);
 
 	if (tb[EVENT_ADD_CLIENT])
 		client = blobmsg_get_string(tb[EVENT_ADD_CLIENT]);
 
+	/* dropped requests are counted too, they are what we are looking for */
+	topk_add(TOPK_EVENT, serial);
+	topk_add(TOPK_EVENT_TYPE, blobmsg_get_string(tb[EVENT_ADD_TYPE]));
+
+	rc = ubus_rate_limited(ctx, req, serial, RATELIMIT_EVENT);
+	if (rc)
+		return rc;
+
 	if (event_add(blobmsg_get_string(tb[EVENT_ADD_TYPE]),
-		      serial, client,
-		      blobmsg_get_string(tb[EVENT_ADD_EVENT])))
+		      serial, client, tb[EVENT_ADD_EVENT]))
 		return UBUS_STATUS_INVALID_ARGUMENT;
 
+	device_seen(serial);
+	notify_send(ctx, "event", serial, blobmsg_get_string(tb[EVENT_ADD_TYPE]), msg);
+
 	return UBUS_STATUS_OK;
 }
 
@@ -294,11 +564,418 @@ ubus_event_list(struct ubus_context *ctx, struct ubus_object *obj,
 	if (tb[EVENT_LIST_CLIENT])
 		client = blobmsg_get_string(tb[EVENT_LIST_CLIENT]);
 
-	if (event_list(&b, type, serial, client,
+	if (ubus_reply_cached(ctx, req, CACHE_EVENT_LIST, msg))
+		return UBUS_STATUS_OK;
+
+	if (event_list(&reply[REPLY_EVENT_LIST], type, serial, client,
 		       blobmsg_get_u32(tb[EVENT_LIST_ROWS])))
 		return UBUS_STATUS_INVALID_ARGUMENT;
 
-	ubus_send_reply(ctx, req, b.head);
+	/* event_list filters by type first, only then by serial */
+	cache_put(CACHE_EVENT_LIST, msg, type ? NULL : serial, reply[REPLY_EVENT_LIST].head);
+	ubus_reply(ctx, req, &reply[REPLY_EVENT_LIST]);
+
+	return UBUS_STATUS_OK;
+}
+
+enum event_search_attr {
+	EVENT_SEARCH_QUERY,
+	EVENT_SEARCH_TYPE,
+	EVENT_SEARCH_SERIAL,
+	EVENT_SEARCH_FROM,
+	EVENT_SEARCH_TO,
+	EVENT_SEARCH_ROWS,
+	EVENT_SEARCH_OFFSET,
+	EVENT_SEARCH_MAX,
+};
+
+static const struct blobmsg_policy event_search_policy[EVENT_SEARCH_MAX] = {
+	[EVENT_SEARCH_QUERY]	= { "query", BLOBMSG_TYPE_STRING },
+	[EVENT_SEARCH_TYPE]	= { "type", BLOBMSG_TYPE_STRING },
+	[EVENT_SEARCH_SERIAL]	= { "serial", BLOBMSG_TYPE_STRING },
+	[EVENT_SEARCH_FROM]	= { "from", BLOBMSG_TYPE_INT64 },
+	[EVENT_SEARCH_TO]	= { "to", BLOBMSG_TYPE_INT64 },
+	[EVENT_SEARCH_ROWS]	= { "rows", BLOBMSG_TYPE_INT32 },
+	[EVENT_SEARCH_OFFSET]	= { "offset", BLOBMSG_TYPE_INT32 },
+};
+
+static int
+ubus_event_search(struct ubus_context *ctx, struct ubus_object *obj,
+		  struct ubus_request_data *req, const char *method,
+		  struct blob_attr *msg)
+{
+	struct blob_attr *tb[EVENT_SEARCH_MAX];
+	char *type = NULL, *serial = NULL;
+	int64_t from = 0, to = INT64_MAX;
+	int offset = 0;
+
+	blobmsg_parse(event_search_policy, EVENT_SEARCH_MAX, tb, blob_data(msg), blob_len(msg));
+
+	if (!tb[EVENT_SEARCH_QUERY] || !tb[EVENT_SEARCH_ROWS])
+		return UBUS_STATUS_INVALID_ARGUMENT;
+
+	if (!config.fts)
+		return UBUS_STATUS_NOT_SUPPORTED;
+
+	if (tb[EVENT_SEARCH_TYPE])
+		type = blobmsg_get_string(tb[EVENT_SEARCH_TYPE]);
+
+	if (tb[EVENT_SEARCH_SERIAL])
+		serial = blobmsg_get_string(tb[EVENT_SEARCH_SERIAL]);
+
+	if (tb[EVENT_SEARCH_FROM])
+		from = blobmsg_get_u64(tb[EVENT_SEARCH_FROM]);
+
+	if (tb[EVENT_SEARCH_TO])
+		to = blobmsg_get_u64(tb[EVENT_SEARCH_TO]);
+
+	if (tb[EVENT_SEARCH_OFFSET])
+		offset = blobmsg_get_u32(tb[EVENT_SEARCH_OFFSET]);
+
+	if (event_search(&reply[REPLY_EVENT_SEARCH], blobmsg_get_string(tb[EVENT_SEARCH_QUERY]), type, serial,
+			 from, to, blobmsg_get_u32(tb[EVENT_SEARCH_ROWS]), offset))
+		return UBUS_STATUS_INVALID_ARGUMENT;
+
+	ubus_reply(ctx, req, &reply[REPLY_EVENT_SEARCH]);
+
+	return UBUS_STATUS_OK;
+}
+
+enum device_timeline_attr {
+	DEVICE_TIMELINE_SERIAL,
+	DEVICE_TIMELINE_FROM,
+	DEVICE_TIMELINE_TO,
+	DEVICE_TIMELINE_ROWS,
+	DEVICE_TIMELINE_OFFSET,
+	DEVICE_TIMELINE_MAX,
+};
+
+static const struct blobmsg_policy device_timeline_policy[DEVICE_TIMELINE_MAX] = {
+	[DEVICE_TIMELINE_SERIAL]	= { "serial", BLOBMSG_TYPE_STRING },
+	[DEVICE_TIMELINE_FROM]		= { "from", BLOBMSG_TYPE_INT64 },
+	[DEVICE_TIMELINE_TO]		= { "to", BLOBMSG_TYPE_INT64 },
+	[DEVICE_TIMELINE_ROWS]		= { "rows", BLOBMSG_TYPE_INT32 },
+	[DEVICE_TIMELINE_OFFSET]	= { "offset", BLOBMSG_TYPE_INT32 },
+};
+
+/* every cursor fetches rows + offset rows, keep that well inside an int */
+#define TIMELINE_MAX_ROWS	1000
+#define TIMELINE_MAX_OFFSET	100000
+
+static int
+ubus_device_timeline(struct ubus_context *ctx, struct ubus_object *obj,
+		     struct ubus_request_data *req, const char *method,
+		     struct blob_attr *msg)
+{
+	struct blob_attr *tb[DEVICE_TIMELINE_MAX];
+	int64_t from = 0, to = INT64_MAX;
+	uint32_t rows, offset = 0;
+
+	blobmsg_parse(device_timeline_policy, DEVICE_TIMELINE_MAX, tb, blob_data(msg), blob_len(msg));
+
+	if (!tb[DEVICE_TIMELINE_SERIAL] || !tb[DEVICE_TIMELINE_ROWS])
+		return UBUS_STATUS_INVALID_ARGUMENT;
+
+	if (tb[DEVICE_TIMELINE_FROM])
+		from = blobmsg_get_u64(tb[DEVICE_TIMELINE_FROM]);
+
+	if (tb[DEVICE_TIMELINE_TO])
+		to = blobmsg_get_u64(tb[DEVICE_TIMELINE_TO]);
+
+	if (tb[DEVICE_TIMELINE_OFFSET])
+		offset = blobmsg_get_u32(tb[DEVICE_TIMELINE_OFFSET]);
+	if (offset > TIMELINE_MAX_OFFSET)
+		offset = TIMELINE_MAX_OFFSET;
+
+	rows = blobmsg_get_u32(tb[DEVICE_TIMELINE_ROWS]);
+	if (rows > TIMELINE_MAX_ROWS)
+		rows = TIMELINE_MAX_ROWS;
+
+	if (device_timeline(&reply[REPLY_DEVICE_TIMELINE], blobmsg_get_string(tb[DEVICE_TIMELINE_SERIAL]), from, to,
+			    rows, offset))
+		return UBUS_STATUS_INVALID_ARGUMENT;
+
+	ubus_reply(ctx, req, &reply[REPLY_DEVICE_TIMELINE]);
+
+	return UBUS_STATUS_OK;
+}
+
+enum event_count_attr {
+	EVENT_COUNT_TYPE,
+	EVENT_COUNT_SERIAL,
+	EVENT_COUNT_FROM,
+	EVENT_COUNT_TO,
+	EVENT_COUNT_HISTOGRAM,
+	EVENT_COUNT_MAX,
+};
+
+static const struct blobmsg_policy event_count_policy[EVENT_COUNT_MAX] = {
+	[EVENT_COUNT_TYPE]	= { "type", BLOBMSG_TYPE_STRING },
+	[EVENT_COUNT_SERIAL]	= { "serial", BLOBMSG_TYPE_STRING },
+	[EVENT_COUNT_FROM]	= { "from", BLOBMSG_TYPE_INT64 },
+	[EVENT_COUNT_TO]	= { "to", BLOBMSG_TYPE_INT64 },
+	[EVENT_COUNT_HISTOGRAM]	= { "histogram", BLOBMSG_TYPE_BOOL },
+};
+
+static int
+ubus_event_count(struct ubus_context *ctx, struct ubus_object *obj,
+		 struct ubus_request_data *req, const char *method,
+		 struct blob_attr *msg)
+{
+	struct blob_attr *tb[EVENT_COUNT_MAX];
+	char *type = NULL, *serial = NULL;
+	int64_t from = 0, to = INT64_MAX;
+	int histogram = 0;
+
+	blobmsg_parse(event_count_policy, EVENT_COUNT_MAX, tb, blob_data(msg), blob_len(msg));
+
+	if (tb[EVENT_COUNT_TYPE])
+		type = blobmsg_get_string(tb[EVENT_COUNT_TYPE]);
+
+	if (tb[EVENT_COUNT_SERIAL])
+		serial = blobmsg_get_string(tb[EVENT_COUNT_SERIAL]);
+
+	if (tb[EVENT_COUNT_FROM])
+		from = blobmsg_get_u64(tb[EVENT_COUNT_FROM]);
+
+	if (tb[EVENT_COUNT_TO])
+		to = blobmsg_get_u64(tb[EVENT_COUNT_TO]);
+
+	if (tb[EVENT_COUNT_HISTOGRAM])
+		histogram = blobmsg_get_bool(tb[EVENT_COUNT_HISTOGRAM]);
+
+	if (event_count(&reply[REPLY_EVENT_COUNT], type, serial, from, to, histogram))
+		return UBUS_STATUS_INVALID_ARGUMENT;
+
+	blobmsg_add_u32(&reply[REPLY_EVENT_COUNT], "bucket", EVENT_COUNT_BUCKET);
+	ubus_reply(ctx, req, &reply[REPLY_EVENT_COUNT]);
+
+	return UBUS_STATUS_OK;
+}
+
+enum subscribe_attr {
+	SUBSCRIBE_SERIAL,
+	SUBSCRIBE_TYPE,
+	SUBSCRIBE_COMPAT,
+	SUBSCRIBE_MAX,
+};
+
+static const struct blobmsg_policy subscribe_policy[SUBSCRIBE_MAX] = {
+	[SUBSCRIBE_SERIAL]	= { "serial", BLOBMSG_TYPE_STRING },
+	[SUBSCRIBE_TYPE]	= { "type", BLOBMSG_TYPE_STRING },
+	[SUBSCRIBE_COMPAT]	= { "compatible", BLOBMSG_TYPE_STRING },
+};
+
+static int
+ubus_subscribe_filter(struct ubus_context *ctx, struct ubus_object *obj,
+		      struct ubus_request_data *req, const char *method,
+		      struct blob_attr *msg)
+{
+	struct blob_attr *tb[SUBSCRIBE_MAX];
+	char *serial = NULL, *type = NULL, *compatible = NULL;
+	struct notify_filter *filter;
+
+	blobmsg_parse(subscribe_policy, SUBSCRIBE_MAX, tb, blob_data(msg), blob_len(msg));
+
+	if (tb[SUBSCRIBE_SERIAL])
+		serial = blobmsg_get_string(tb[SUBSCRIBE_SERIAL]);
+
+	if (tb[SUBSCRIBE_TYPE])
+		type = blobmsg_get_string(tb[SUBSCRIBE_TYPE]);
+
+	if (tb[SUBSCRIBE_COMPAT])
+		compatible = blobmsg_get_string(tb[SUBSCRIBE_COMPAT]);
+
+	filter = notify_filter_get(ctx, serial, type, compatible);
+	if (!filter)
+		return UBUS_STATUS_UNKNOWN_ERROR;
+
+	blob_buf_init(&reply[REPLY_SUBSCRIBE], 0);
+	blobmsg_add_string(&reply[REPLY_SUBSCRIBE], "object", filter->name);
+	ubus_reply(ctx, req, &reply[REPLY_SUBSCRIBE]);
+
+	return UBUS_STATUS_OK;
+}
+
+enum backup_attr {
+	BACKUP_PATH,
+	BACKUP_MAX,
+};
+
+static const struct blobmsg_policy backup_policy[BACKUP_MAX] = {
+	[BACKUP_PATH]	= { "path", BLOBMSG_TYPE_STRING },
+};
+
+static int
+ubus_backup(struct ubus_context *ctx, struct ubus_object *obj,
+	    struct ubus_request_data *req, const char *method,
+	    struct blob_attr *msg)
+{
+	struct blob_attr *tb[BACKUP_MAX];
+
+	blobmsg_parse(backup_policy, BACKUP_MAX, tb, blob_data(msg), blob_len(msg));
+
+	if (!tb[BACKUP_PATH])
+		return UBUS_STATUS_INVALID_ARGUMENT;
+
+	if (backup_start(blobmsg_get_string(tb[BACKUP_PATH])))
+		return UBUS_STATUS_UNKNOWN_ERROR;
+
+	return UBUS_STATUS_OK;
+}
+
+enum export_attr {
+	EXPORT_SERIAL,
+	EXPORT_PATH,
+	EXPORT_FORMAT,
+	EXPORT_FROM,
+	EXPORT_TO,
+	EXPORT_MAX,
+};
+
+static const struct blobmsg_policy export_policy[EXPORT_MAX] = {
+	[EXPORT_SERIAL]	= { "serial", BLOBMSG_TYPE_STRING },
+	[EXPORT_PATH]	= { "path", BLOBMSG_TYPE_STRING },
+	[EXPORT_FORMAT]	= { "format", BLOBMSG_TYPE_STRING },
+	[EXPORT_FROM]	= { "from", BLOBMSG_TYPE_INT64 },
+	[EXPORT_TO]	= { "to", BLOBMSG_TYPE_INT64 },
+};
+
+static int
+ubus_export(struct ubus_context *ctx, struct ubus_object *obj,
+	    struct ubus_request_data *req, const char *method,
+	    struct blob_attr *msg)
+{
+	struct blob_attr *tb[EXPORT_MAX];
+	int64_t from = 0, to = INT64_MAX;
+	int json = 0;
+
+	blobmsg_parse(export_policy, EXPORT_MAX, tb, blob_data(msg), blob_len(msg));
+
+	if (!tb[EXPORT_SERIAL] || !tb[EXPORT_PATH])
+		return UBUS_STATUS_INVALID_ARGUMENT;
+
+	if (tb[EXPORT_FORMAT]) {
+		char *format = blobmsg_get_string(tb[EXPORT_FORMAT]);
+
+		if (!strcmp(format, "json"))
+			json = 1;
+		else if (strcmp(format, "blob"))
+			return UBUS_STATUS_INVALID_ARGUMENT;
+	}
+
+	if (tb[EXPORT_FROM])
+		from = blobmsg_get_u64(tb[EXPORT_FROM]);
+
+	if (tb[EXPORT_TO])
+		to = blobmsg_get_u64(tb[EXPORT_TO]);
+
+	/* progress and the result show up in stats */
+	if (export_serial(blobmsg_get_string(tb[EXPORT_PATH]), json,
+			  blobmsg_get_string(tb[EXPORT_SERIAL]), from, to))
+		return UBUS_STATUS_UNKNOWN_ERROR;
+
+	return UBUS_STATUS_OK;
+}
+
+static int
+ubus_stats(struct ubus_context *ctx, struct ubus_object *obj,
+	   struct ubus_request_data *req, const char *method,
+	   struct blob_attr *msg)
+{
+	struct blob_buf *buf = &reply[REPLY_STATS];
+	void *c;
+
+	blob_buf_init(buf, 0);
+
+	c = blobmsg_open_table(buf, "ratelimit");
+	ratelimit_stats(buf);
+	blobmsg_close_table(buf, c);
+
+	c = blobmsg_open_table(buf, "backup");
+	backup_status(buf);
+	blobmsg_close_table(buf, c);
+
+	c = blobmsg_open_table(buf, "export");
+	export_status(buf);
+	blobmsg_close_table(buf, c);
+
+	c = blobmsg_open_table(buf, "budget");
+	budget_status(buf);
+	blobmsg_close_table(buf, c);
+
+	c = blobmsg_open_table(buf, "memory");
+	mem_stats(buf);
+	blobmsg_close_table(buf, c);
+
+	c = blobmsg_open_table(buf, "replication");
+	repl_status(buf);
+	blobmsg_close_table(buf, c);
+
+	c = blobmsg_open_table(buf, "cache");
+	cache_stats(buf);
+	blobmsg_close_table(buf, c);
+
+	ubus_reply(ctx, req, buf);
+
+	return UBUS_STATUS_OK;
+}
+
+enum top_attr {
+	TOP_COUNT,
+	TOP_MAX,
+};
+
+static const struct blobmsg_policy top_policy[TOP_MAX] = {
+	[TOP_COUNT]	= { "count", BLOBMSG_TYPE_INT32 },
+};
+
+static int
+ubus_top(struct ubus_context *ctx, struct ubus_object *obj,
+	 struct ubus_request_data *req, const char *method,
+	 struct blob_attr *msg)
+{
+	struct blob_attr *tb[TOP_MAX];
+	int count = 0;
+
+	blobmsg_parse(top_policy, TOP_MAX, tb, blob_data(msg), blob_len(msg));
+
+	if (tb[TOP_COUNT])
+		count = blobmsg_get_u32(tb[TOP_COUNT]);
+
+	blob_buf_init(&reply[REPLY_TOP], 0);
+	topk_dump(&reply[REPLY_TOP], count);
+	ubus_reply(ctx, req, &reply[REPLY_TOP]);
+
+	return UBUS_STATUS_OK;
+}
+
+enum slow_queries_attr {
+	SLOW_QUERIES_CLEAR,
+	SLOW_QUERIES_MAX,
+};
+
+static const struct blobmsg_policy slow_queries_policy[SLOW_QUERIES_MAX] = {
+	[SLOW_QUERIES_CLEAR]	= { "clear", BLOBMSG_TYPE_BOOL },
+};
+
+static int
+ubus_slow_queries(struct ubus_context *ctx, struct ubus_object *obj,
+		  struct ubus_request_data *req, const char *method,
+		  struct blob_attr *msg)
+{
+	struct blob_attr *tb[SLOW_QUERIES_MAX];
+	int clear = 0;
+
+	blobmsg_parse(slow_queries_policy, SLOW_QUERIES_MAX, tb, blob_data(msg), blob_len(msg));
+
+	/* drop the records once they have been returned */
+	if (tb[SLOW_QUERIES_CLEAR])
+		clear = blobmsg_get_bool(tb[SLOW_QUERIES_CLEAR]);
+
+	blob_buf_init(&reply[REPLY_SLOW_QUERIES], 0);
+	slowlog_dump(&reply[REPLY_SLOW_QUERIES], clear);
+	ubus_reply(ctx, req, &reply[REPLY_SLOW_QUERIES]);
 
 	return UBUS_STATUS_OK;
 }
@@ -306,13 +983,22 @@ ubus_event_list(struct ubus_context *ctx, struct ubus_object *obj,
 static const struct ubus_method urender_methods[] = {
 	UBUS_METHOD("device_add", ubus_device_add, device_add_policy),
 	UBUS_METHOD("device_remove", ubus_device_remove, device_remove_policy),
-	UBUS_METHOD_NOARG("device_list", ubus_device_list),
+	UBUS_METHOD("device_list", ubus_device_list, device_list_policy),
+	UBUS_METHOD("device_timeline", ubus_device_timeline, device_timeline_policy),
 	UBUS_METHOD("state_add", ubus_state_add, state_add_policy),
 	UBUS_METHOD("state_list", ubus_state_list, state_list_policy),
 	UBUS_METHOD("health_add", ubus_health_add, health_add_policy),
 	UBUS_METHOD("health_list", ubus_health_list, health_list_policy),
 	UBUS_METHOD("event_add", ubus_event_add, event_add_policy),
 	UBUS_METHOD("event_list", ubus_event_list, event_list_policy),
+	UBUS_METHOD("event_search", ubus_event_search, event_search_policy),
+	UBUS_METHOD("event_count", ubus_event_count, event_count_policy),
+	UBUS_METHOD("subscribe", ubus_subscribe_filter, subscribe_policy),
+	UBUS_METHOD("backup", ubus_backup, backup_policy),
+	UBUS_METHOD("export", ubus_export, export_policy),
+	UBUS_METHOD_NOARG("stats", ubus_stats),
+	UBUS_METHOD("top", ubus_top, top_policy),
+	UBUS_METHOD("slow_queries", ubus_slow_queries, slow_queries_policy),
 };
 
 static struct ubus_object_type urender_object_type =
@@ -325,12 +1011,37 @@ static struct ubus_object urender_object = {
 	.n_methods = ARRAY_SIZE(urender_methods),
 };
 
+/* a follower only mirrors its primary, it serves reads under a name of its own */
+static const struct ubus_method follower_methods[] = {
+	UBUS_METHOD("device_list", ubus_device_list, device_list_policy),
+	UBUS_METHOD("device_timeline", ubus_device_timeline, device_timeline_policy),
+	UBUS_METHOD("state_list", ubus_state_list, state_list_policy),
+	UBUS_METHOD("health_list", ubus_health_list, health_list_policy),
+	UBUS_METHOD("event_list", ubus_event_list, event_list_policy),
+	UBUS_METHOD("event_count", ubus_event_count, event_count_policy),
+	UBUS_METHOD("backup", ubus_backup, backup_policy),
+	UBUS_METHOD("export", ubus_export, export_policy),
+	UBUS_METHOD_NOARG("stats", ubus_stats),
+	UBUS_METHOD("slow_queries", ubus_slow_queries, slow_queries_policy),
+};
+
+static struct ubus_object_type follower_object_type =
+	UBUS_OBJECT_TYPE("collect.follower", follower_methods);
+
+static struct ubus_object follower_object = {
+	.name = "collect.follower",
+	.type = &follower_object_type,
+	.methods = follower_methods,
+	.n_methods = ARRAY_SIZE(follower_methods),
+};
+
 static void
 ubus_connect_handler(struct ubus_context *ctx)
 {
 	int ret;
 
-	ret = ubus_add_object(ctx, &urender_object);
+	/* only runs on the first connect, ubus_reconnect() re-adds every object itself */
+	ret = ubus_add_object(ctx, config.follow ? &follower_object : &urender_object);
 	if (ret)
 		fprintf(stderr, "Failed to add object: %s\n", ubus_strerror(ret));
 }
@@ -345,6 +1056,11 @@ ubus_startup(void)
 void
 ubus_stop(void)
 {
+	int i;
+
 	ubus_auto_shutdown(&conn);
+	for (i = 0; i < __REPLY_MAX; i++)
+		blob_buf_free(&reply[i]);
+	cache_stop();
 	blob_buf_free(&b);
 }